@@ -0,0 +1,622 @@
+/*
+ * neoaconnect_bench - timings of neoaconnect against the in-memory sequencer
+ *
+ *   neoaconnect_bench [--list] [CASE...]
+ *
+ * runs every case, or only those named, at 10, 100, 1000 and 10000 ports.
+ * each line gives the best of as many runs as fit in a fifth of a second,
+ * and the sequencer calls a single run makes where that matters
+ */
+
+#define NEOACONNECT_NO_MAIN
+#include "../neoaconnect.cpp"
+
+#include <atomic>
+#include <fcntl.h>
+#include <functional>
+#include <malloc.h>
+#include <regex>
+#include <unistd.h>
+
+// allocations made while counting is set, for the memory case
+std::atomic<bool> counting{false};
+std::atomic<long> allocations{0}, allocated_bytes{0}, freed_bytes{0};
+
+void *operator new(size_t size) {
+  void *p = malloc(size ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  if (p != nullptr && counting.load(std::memory_order_relaxed)) {
+    freed_bytes.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+  }
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+namespace {
+
+struct Size {
+  int clients, ports_per_client, edges_per_port;
+  int ports() const { return clients * ports_per_client; }
+};
+
+const Size sizes[] = {{5, 2, 4}, {10, 10, 4}, {20, 50, 4}, {100, 100, 4}};
+
+/*
+ * the best time of run() in microseconds, out of at least three runs
+ */
+template <typename F> double best_us(F &&run) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  double best = 1e300;
+  auto enough = std::chrono::milliseconds(200);
+  for (int n = 0; n < 3 || clock::now() - start < enough; n++) {
+    auto t0 = clock::now();
+    run();
+    std::chrono::duration<double, std::micro> took = clock::now() - t0;
+    best = std::min(best, took.count());
+  }
+  return best;
+}
+
+/*
+ * the same for runs that leave their setup out of the time: run() returns
+ * the microseconds since the given start, taken after the setup
+ */
+template <typename F> double best_timed_us(F &&run) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  double best = 1e300;
+  auto enough = std::chrono::milliseconds(200);
+  for (int n = 0; n < 3 || clock::now() - start < enough; n++) {
+    best = std::min(best, run());
+  }
+  return best;
+}
+
+double since_us(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+long total_calls(Trace &trace) {
+  long total = 0;
+  for (int c = 0; c < Trace::NUM_CALLS; c++) {
+    total += trace.calls((Trace::call)c);
+  }
+  return total;
+}
+
+void report(const char *bench, const Size &size, const char *variant,
+            double us, long calls = -1) {
+  fmt::print("{:<10} {:>6} ports  {:<16} {:>12.2f} us", bench, size.ports(),
+             variant, us);
+  if (calls >= 0) {
+    fmt::print(" {:>9} calls", calls);
+  }
+  fmt::print("\n");
+}
+
+// every client, port and connection, as -l and the daemon load them
+void load_all(Seq &seq) {
+  for (auto client : *seq.get_clients()) {
+    for (auto port : *client->get_ports()) {
+      port->get_connections();
+    }
+  }
+}
+
+/*
+ * what it costs to get ready for a command: resolving the two addresses of
+ * a connect, listing the ports, and the full walk over every client, port
+ * and subscriber that Seq() used to make before anything else
+ */
+void bench_startup() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    auto connect = [](Seq &seq) {
+      snd_seq_addr_t sender, dest;
+      seq.parse_address(&sender, "16:0");
+      seq.parse_address(&dest, "17:1");
+    };
+    auto ports = [](Seq &seq) {
+      for (auto client : *seq.get_clients()) {
+        client->get_ports();
+      }
+    };
+    auto full = [&](Seq &seq) {
+      load_all(seq);
+      connect(seq);
+    };
+    std::pair<const char *, std::function<void(Seq &)>> variants[] = {
+        {"connect", connect}, {"ports", ports}, {"full", full}};
+    for (auto &[name, load] : variants) {
+      double us = best_us([&] {
+        Seq seq(world.open_another());
+        load(seq);
+      });
+      Trace trace;
+      {
+        Seq seq(
+            std::make_unique<CountingBackend>(world.open_another(), &trace));
+        load(seq);
+      }
+      report("startup", size, name, us, total_calls(trace));
+    }
+  }
+}
+
+/*
+ * splitting the address of every port of a topology, as a batch restore
+ * does, with the tokenizer and with the regex it replaced, both compiled
+ * once and, as parse_address used to, on every call. the last takes
+ * seconds past a thousand ports and is left out there
+ */
+void bench_address() {
+  const char *pattern =
+      "[\'\"]?([^:\\.]+)?[\'\"]?[:\\.]?[\'\"]?([^:\\.]+)?[\'\"]?";
+  const std::regex addr_regex_full(pattern);
+  auto regex_split = [](const std::regex &re, const std::string &arg) {
+    std::smatch addr_parts;
+    return std::regex_match(arg, addr_parts, re) &&
+           addr_parts[1].length() + addr_parts[2].length() > 0;
+  };
+  for (auto &size : sizes) {
+    std::vector<std::string> addresses;
+    for (int c = 0; c < size.clients; c++) {
+      for (int p = 0; p < size.ports_per_client; p++) {
+        addresses.push_back(fmt::format("Synth {}:Synth {} Port {}", c, c, p));
+      }
+    }
+    long parsed = 0;
+    double us = best_us([&] {
+      char scratch[256];
+      std::string_view client, port;
+      for (auto &address : addresses) {
+        parsed += Seq::split_address(address, client, port, scratch,
+                                     sizeof(scratch));
+      }
+    });
+    report("address", size, "split", us);
+    us = best_us([&] {
+      for (auto &address : addresses) {
+        parsed += regex_split(addr_regex_full, address);
+      }
+    });
+    report("address", size, "regex", us);
+    if (size.ports() <= 1000) {
+      us = best_us([&] {
+        for (auto &address : addresses) {
+          parsed += regex_split(std::regex(pattern), address);
+        }
+      });
+      report("address", size, "regex/call", us);
+    }
+    if (parsed == 0) {
+      fmt::print(stderr, "nothing was parsed\n");
+    }
+  }
+}
+
+/*
+ * connect some ports and disconnect them again, and bring up a few clients
+ * with a port each and let them go, on a handle of its own
+ */
+void churn(MemoryBackend &world, const Size &size) {
+  auto handle = world.open_another();
+  snd_seq_port_subscribe_t *subs;
+  snd_seq_port_subscribe_alloca(&subs);
+  std::vector<std::pair<snd_seq_addr_t, snd_seq_addr_t>> made;
+  for (int i = 0; i < 500; i++) {
+    snd_seq_addr_t sender = {(unsigned char)(16 + i % size.clients),
+                             (unsigned char)(i % size.ports_per_client)};
+    snd_seq_addr_t dest = {
+        (unsigned char)(16 + (i * 7 + 3) % size.clients),
+        (unsigned char)((i * 3 + 1) % size.ports_per_client)};
+    snd_seq_port_subscribe_set_sender(subs, &sender);
+    snd_seq_port_subscribe_set_dest(subs, &dest);
+    if (handle->subscribe(subs) == 0) {
+      made.push_back({sender, dest});
+    }
+  }
+  for (auto &[sender, dest] : made) {
+    snd_seq_port_subscribe_set_sender(subs, &sender);
+    snd_seq_port_subscribe_set_dest(subs, &dest);
+    handle->unsubscribe(subs);
+  }
+  for (int i = 0; i < 50; i++) {
+    world.open_another()->create_port("Churn", SND_SEQ_PORT_CAP_READ, -1);
+  }
+}
+
+/*
+ * keeping a loaded topology up to date from announcements, per event, and
+ * loading all of it again as would be needed without them. the patched
+ * topology is checked against a fresh one at the end
+ */
+void bench_update() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    size_t events = 0;
+    int differences = 0;
+    double us = best_timed_us([&] {
+      auto handle = world.open_another();
+      Backend *announcements = handle.get();
+      announcements->open_announce_port();
+      Seq seq(std::move(handle));
+      load_all(seq);
+      churn(world, size);
+
+      std::vector<snd_seq_event_t> pending;
+      snd_seq_event_t *ev;
+      while (announcements->event_input(&ev) >= 0) {
+        pending.push_back(*ev);
+      }
+      auto t0 = std::chrono::steady_clock::now();
+      for (auto &ev : pending) {
+        seq.update_topology(&ev);
+      }
+      double took = since_us(t0);
+      events = pending.size();
+      differences += seq.check_topology();
+      return took;
+    });
+    report("update", size, "per event", us / std::max<size_t>(events, 1));
+    us = best_us([&] {
+      Seq seq(world.open_another());
+      load_all(seq);
+    });
+    report("update", size, "rescan", us);
+    if (differences != 0) {
+      fmt::print(stderr, "{} differences after the updates\n", differences);
+    }
+  }
+}
+
+/*
+ * stdout goes to path, by default /dev/null, for as long as this is in
+ * scope
+ */
+class Redirect {
+public:
+  Redirect(const char *path = "/dev/null") {
+    fflush(stdout);
+    saved_ = dup(STDOUT_FILENO);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+
+  ~Redirect() {
+    fflush(stdout);
+    dup2(saved_, STDOUT_FILENO);
+    close(saved_);
+  }
+
+private:
+  int saved_;
+};
+
+/*
+ * -l on a fresh handle, with every port's connections out and in. then,
+ * once the same is loaded, finding the connections coming in with the
+ * inbound index and in the way print_list did before it: by going through
+ * every connection of every port of the client, for each of its ports, which
+ * only ever found senders of the same client
+ */
+void bench_list() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    double us;
+    {
+      Redirect quiet;
+      us = best_us([&] {
+        Seq seq(world.open_another());
+        seq.print_list(true);
+      });
+    }
+    report("list", size, "list", us);
+
+    us = best_timed_us([&] {
+      Seq seq(world.open_another());
+      load_all(seq);
+      auto t0 = std::chrono::steady_clock::now();
+      seq.index_inbound();
+      return since_us(t0);
+    });
+    report("list", size, "index", us);
+
+    long found = 0;
+    us = best_timed_us([&] {
+      Seq seq(world.open_another());
+      load_all(seq);
+      auto t0 = std::chrono::steady_clock::now();
+      for (auto client : *seq.get_clients()) {
+        for (auto port : *client->get_ports()) {
+          for (auto other : *client->get_ports()) {
+            for (auto &conn : other->get_connections()) {
+              found += conn.client_id_ == client->get_index() &&
+                       conn.port_id_ == port->get_index();
+            }
+          }
+        }
+      }
+      return since_us(t0);
+    });
+    report("list", size, "old inbound", us);
+    if (found < 0) {
+      fmt::print(stderr, "unreachable\n");
+    }
+  }
+}
+
+// the peak resident set size in KiB, from /proc/self/status
+long peak_rss_kib() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return atol(line.c_str() + 6);
+    }
+  }
+  return -1;
+}
+
+/*
+ * what loading the topology for -l, -p and -s allocates, how much of it
+ * the snapshot still holds when the command is done, and the peak RSS of
+ * the process. the in-memory sequencer's answers to queries are counted
+ * too, and its topology is part of the peak, which is reset before each
+ * command where the kernel allows it
+ */
+void bench_memory() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    std::pair<const char *, std::function<void(Seq &)>> commands[] = {
+        {"-l", [](Seq &seq) { seq.print_list(true); }},
+        {"-p", [](Seq &seq) { seq.print_all_ports(); }},
+        {"-s", [](Seq &seq) { seq.serialize_connections(); }},
+    };
+    for (auto &[name, command] : commands) {
+      std::ofstream("/proc/self/clear_refs") << "5";
+      allocations = allocated_bytes = freed_bytes = 0;
+      long held;
+      {
+        Redirect quiet;
+        Seq seq(world.open_another());
+        counting = true;
+        command(seq);
+        held = allocated_bytes - freed_bytes;
+        counting = false;
+      }
+      fmt::print("{:<10} {:>6} ports  {:<16} {:>9} allocs {:>9.1f} KiB "
+                 "allocated {:>9.1f} KiB held {:>9.1f} MiB peak RSS\n",
+                 "memory", size.ports(), name, allocations.load(),
+                 allocated_bytes / 1024.0, held / 1024.0,
+                 peak_rss_kib() / 1024.0);
+    }
+  }
+}
+
+/*
+ * a full scan of every port and its connections on 1 to 8 threads, as -l
+ * --threads does. the in-memory sequencer answers far faster than the
+ * kernel, so the scan is also run with every call delayed by 20 us, which
+ * the threads can overlap. that is left out past a thousand ports, where
+ * a single run takes seconds
+ */
+void bench_scale() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    for (auto latency : {0, 20}) {
+      if (latency > 0 && size.ports() > 1000) {
+        continue;
+      }
+      world.set_latency(std::chrono::microseconds(latency));
+      for (int threads : {1, 2, 4, 8}) {
+        double us = best_us([&] {
+          Seq seq(world.open_another());
+          seq.scan(threads, true);
+          load_all(seq);
+        });
+        report("scale", size,
+               fmt::format("threads {}{}", threads, latency ? " +20us" : "")
+                   .c_str(),
+               us);
+      }
+    }
+  }
+}
+
+/*
+ * the commands the in-memory sequencer was added to time: enumerating the
+ * topology, resolving the address of a port by name (per address), -l,
+ * -s and -S of what -s printed. -S removes every connection and makes them
+ * all again
+ */
+void bench_suite() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    double us = best_us([&] {
+      Seq seq(world.open_another());
+      load_all(seq);
+    });
+    report("suite", size, "enumerate", us);
+
+    std::vector<std::string> addresses;
+    for (int c = 0; c < size.clients; c++) {
+      for (int p = 0; p < size.ports_per_client; p++) {
+        addresses.push_back(fmt::format("Synth {}:Synth {} Port {}", c, c, p));
+      }
+    }
+    {
+      Seq seq(world.open_another());
+      load_all(seq);
+      int unresolved = 0;
+      us = best_us([&] {
+        snd_seq_addr_t addr;
+        for (auto &address : addresses) {
+          unresolved += seq.parse_address(&addr, address) != 0;
+        }
+      });
+      report("suite", size, "parse_address", us / addresses.size());
+      if (unresolved != 0) {
+        fmt::print(stderr, "{} addresses did not resolve\n", unresolved);
+      }
+    }
+
+    char profile[] = "/tmp/neoaconnect_benchXXXXXX";
+    close(mkstemp(profile));
+    {
+      Redirect quiet;
+      us = best_us([&] {
+        Seq seq(world.open_another());
+        seq.print_list(true);
+      });
+    }
+    report("suite", size, "print_list", us);
+    {
+      Redirect quiet;
+      us = best_us([&] {
+        Seq seq(world.open_another());
+        seq.serialize_connections();
+      });
+    }
+    report("suite", size, "serialize", us);
+    {
+      Redirect to_profile(profile);
+      Seq(world.open_another()).serialize_connections();
+    }
+    int failed = 0;
+    {
+      Redirect quiet;
+      us = best_us([&] {
+        Seq seq(world.open_another());
+        failed += seq.deserialize_connections(profile) != 0;
+      });
+    }
+    report("suite", size, "deserialize", us);
+    if (failed != 0) {
+      fmt::print(stderr, "{} restores failed\n", failed);
+    }
+    unlink(profile);
+  }
+}
+
+/*
+ * -S of what -s printed on 1 to 8 --threads workers, which removes every
+ * connection and makes it again, so each run applies two routes per
+ * connection. as in the scale case, it is also run with every call delayed
+ * by 20 us up to a thousand ports
+ */
+void bench_restore() {
+  for (auto &size : sizes) {
+    MemoryBackend world(size.clients, size.ports_per_client,
+                        size.edges_per_port);
+    char profile[] = "/tmp/neoaconnect_benchXXXXXX";
+    close(mkstemp(profile));
+    {
+      Redirect to_profile(profile);
+      Seq(world.open_another()).serialize_connections();
+    }
+    long routes = 0;
+    {
+      Seq seq(world.open_another());
+      for (auto client : *seq.get_clients()) {
+        for (auto port : *client->get_ports()) {
+          routes += 2 * port->get_connections().size();
+        }
+      }
+    }
+
+    for (auto latency : {0, 20}) {
+      if (latency > 0 && size.ports() > 1000) {
+        continue;
+      }
+      world.set_latency(std::chrono::microseconds(latency));
+      for (int threads : {1, 2, 4, 8}) {
+        int failed = 0;
+        double us;
+        {
+          Redirect quiet;
+          us = best_us([&] {
+            Seq seq(world.open_another());
+            seq.set_threads(threads);
+            failed += seq.deserialize_connections(profile) != 0;
+          });
+        }
+        auto variant =
+            fmt::format("threads {}{}", threads, latency ? " +20us" : "");
+        fmt::print("{:<10} {:>6} ports  {:<16} {:>12.2f} us {:>9.0f} "
+                   "routes/s\n",
+                   "restore", size.ports(), variant, us, routes * 1e6 / us);
+        if (failed != 0) {
+          fmt::print(stderr, "{} restores failed\n", failed);
+        }
+      }
+    }
+    world.set_latency(std::chrono::nanoseconds(0));
+    unlink(profile);
+  }
+}
+
+struct Case {
+  const char *name;
+  void (*run)();
+};
+
+const Case cases[] = {
+    {"startup", bench_startup},
+    {"address", bench_address},
+    {"update", bench_update},
+    {"list", bench_list},
+    {"memory", bench_memory},
+    {"scale", bench_scale},
+    {"suite", bench_suite},
+    {"restore", bench_restore},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--list") == 0) {
+    for (auto &c : cases) {
+      fmt::print("{}\n", c.name);
+    }
+    return 0;
+  }
+  for (int i = 1; i < argc; i++) {
+    auto named = [&](const Case &c) {
+      return strcmp(c.name, argv[i]) == 0;
+    };
+    if (std::none_of(std::begin(cases), std::end(cases), named)) {
+      fmt::print(stderr, "unknown case '{}'\n", argv[i]);
+      return 1;
+    }
+  }
+  for (auto &c : cases) {
+    if (argc == 1 || std::any_of(argv + 1, argv + argc, [&](const char *arg) {
+          return strcmp(c.name, arg) == 0;
+        })) {
+      c.run();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * address_fuzz - fuzz target for Seq::split_address
+ *
+ * built for libFuzzer with -DNEOACONNECT_LIBFUZZER=ON, otherwise with a main
+ * of its own:
+ *
+ *   address_fuzz FILE...   run the given inputs
+ *   address_fuzz [N]       run N generated inputs (default 100000)
+ *
+ * every input is checked for
+ *  - the client and port views pointing into the input or the scratch buffer
+ *  - the same split as the regex parse_address used before the tokenizer,
+ *    for inputs that use neither quotes nor backslashes
+ *  - escape_name of both parts splitting back into the same names
+ * and the process aborts on the first input that fails
+ */
+
+#define NEOACONNECT_NO_MAIN
+#include "../neoaconnect.cpp"
+
+#include <regex>
+
+namespace {
+
+void check(bool ok, const char *what, std::string_view input) {
+  if (!ok) {
+    fmt::print(stderr, "{} for input \"", what);
+    for (unsigned char c : input) {
+      if (isprint(c)) {
+        fmt::print(stderr, "{:c}", c);
+      } else {
+        fmt::print(stderr, "\\x{:02x}", c);
+      }
+    }
+    fmt::print(stderr, "\"\n");
+    abort();
+  }
+}
+
+bool inside(std::string_view part, std::string_view buffer) {
+  return part.empty() || (part.data() >= buffer.data() &&
+                          part.data() + part.size() <=
+                              buffer.data() + buffer.size());
+}
+
+/*
+ * the split parse_address made before the tokenizer. both parts empty is
+ * taken as a failure, the same as split_address does
+ */
+bool regex_split(const std::string &arg, std::string &client,
+                 std::string &port) {
+  static const std::regex addr_regex_full(
+      "[\'\"]?([^:\\.]+)?[\'\"]?[:\\.]?[\'\"]?([^:\\.]+)?[\'\"]?");
+  std::smatch addr_parts;
+  if (!std::regex_match(arg, addr_parts, addr_regex_full)) {
+    return false;
+  }
+  client = addr_parts[1].str();
+  port = addr_parts[2].str();
+  return client.size() || port.size();
+}
+
+void run(std::string_view input) {
+  char scratch[256];
+  std::string_view client, port;
+  bool split = Seq::split_address(input, client, port, scratch,
+                                  sizeof(scratch));
+  if (split) {
+    std::string_view buffer(scratch, sizeof(scratch));
+    check(inside(client, input) || inside(client, buffer),
+          "client outside of input", input);
+    check(inside(port, input) || inside(port, buffer),
+          "port outside of input", input);
+  }
+
+  // the regex never had a notion of quoting or escaping, and the empty
+  // address was never passed to it
+  if (!input.empty() &&
+      input.find_first_of("'\"\\") == std::string_view::npos) {
+    std::string old_client, old_port;
+    bool old_split = regex_split(std::string(input), old_client, old_port);
+    check(split == old_split, "split differs from the regex", input);
+    check(!split || (client == old_client && port == old_port),
+          "parts differ from the regex", input);
+  }
+
+  if (split) {
+    std::string escaped;
+    Seq::escape_name(client, escaped);
+    escaped += ':';
+    Seq::escape_name(port, escaped);
+    // unescaping never makes the names longer than they were escaped
+    std::vector<char> again_scratch(escaped.size());
+    std::string_view again_client, again_port;
+    check(Seq::split_address(escaped, again_client, again_port,
+                             again_scratch.data(), again_scratch.size()),
+          "escaped names do not split", input);
+    check(again_client == client && again_port == port,
+          "escaped names split differently", input);
+  }
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  run(std::string_view((const char *)data, size));
+  return 0;
+}
+
+#ifndef NEOACONNECT_LIBFUZZER
+int main(int argc, char **argv) {
+  int runs = 100000;
+  if (argc == 2 && isdigit((unsigned char)argv[1][0])) {
+    runs = atoi(argv[1]);
+  } else if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      std::ifstream file(argv[i], std::ios::binary);
+      if (!file) {
+        fmt::print(stderr, "can't open {}\n", argv[i]);
+        return 1;
+      }
+      std::string input((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
+      run(input);
+    }
+    return 0;
+  }
+
+  // short strings over the characters that mean something to the parser,
+  // from a fixed seed so a failure shows up again on the next run
+  static const char alphabet[] = "ab1 :.:.'\"\\";
+  uint32_t state = 1;
+  auto random = [&](int n) {
+    state = state * 1664525 + 1013904223;
+    return (int)((state >> 8) % n);
+  };
+  std::string input;
+  for (int i = 0; i < runs; i++) {
+    input.clear();
+    for (int n = random(12); n > 0; n--) {
+      input += alphabet[random(sizeof(alphabet) - 1)];
+    }
+    run(input);
+  }
+  fmt::print("{} inputs\n", runs);
+  return 0;
+}
+#endif
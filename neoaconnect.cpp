@@ -16,396 +16,443 @@
  */
 
 #include <alsa/asoundlib.h>
+#include <algorithm>
+#include <atomic>
 #include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <fmt/core.h>
+#include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <optional>
 #include <regex>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
 #include <toml++/toml.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-struct Connection {
-  int client_id_;
-  int port_id_;
-  std::string client_name_;
-  std::string port_name_;
-};
-
-class Port {
+/*
+ * stores every distinct client and port name once, packed into large
+ * blocks. the views it hands out stay valid for as long as the pool lives,
+ * so names are never copied per port or per connection
+ */
+class NamePool {
 public:
-  Port(snd_seq_t *seq, int client_id, std::string client_name, int index,
-       std::string name, unsigned int capability)
-      : seq_(seq), client_id_(client_id), client_name_(client_name),
-        index_(index), name_(name), capability_(capability) {
-    populate_connections();
+  std::string_view intern(std::string_view name) {
+    auto it = names_.find(name);
+    if (it != names_.end()) {
+      return *it;
+    }
+    if (name.size() > block_left_) {
+      size_t size = std::max(block_size, name.size());
+      blocks_.emplace_back(new char[size]);
+      block_ptr_ = blocks_.back().get();
+      block_left_ = size;
+    }
+    std::copy(name.begin(), name.end(), block_ptr_);
+    std::string_view interned(block_ptr_, name.size());
+    block_ptr_ += name.size();
+    block_left_ -= name.size();
+    names_.insert(interned);
+    return interned;
   }
 
-  const int get_client_id() { return client_id_; }
-
-  const std::string get_client_name() { return client_name_; }
+private:
+  static constexpr size_t block_size = 4096;
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char *block_ptr_ = nullptr;
+  size_t block_left_ = 0;
+  std::unordered_set<std::string_view> names_;
+};
 
-  const int get_index() { return index_; }
+/*
+ * allocates objects side by side in fixed size blocks and reuses the slots
+ * of destroyed ones, so loading a topology costs a handful of allocations
+ * instead of one per client and port. pointers stay valid until destroy()
+ */
+template <typename T> class ObjectPool {
+public:
+  ObjectPool() = default;
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
 
-  const std::string get_name() { return name_; }
+  ~ObjectPool() {
+    for (auto &block : blocks_) {
+      for (size_t i = 0; i < block_size; i++) {
+        if (block[i].live) {
+          block[i].get()->~T();
+        }
+      }
+    }
+  }
 
-  unsigned int get_capability() { return capability_; }
+  template <typename... Args> T *create(Args &&...args) {
+    Slot *slot;
+    if (!free_.empty()) {
+      slot = free_.back();
+      free_.pop_back();
+    } else {
+      if (block_used_ == block_size || blocks_.empty()) {
+        blocks_.emplace_back(new Slot[block_size]);
+        block_used_ = 0;
+      }
+      slot = &blocks_.back()[block_used_++];
+    }
+    T *object = new (slot->storage) T(std::forward<Args>(args)...);
+    slot->live = true;
+    return object;
+  }
 
-  std::vector<Connection> get_connections() { return connections_; }
+  void destroy(T *object) {
+    object->~T();
+    // storage is the first member, so the slot starts where the object does
+    auto slot = reinterpret_cast<Slot *>(object);
+    slot->live = false;
+    free_.push_back(slot);
+  }
 
 private:
-  snd_seq_t *seq_;
-  int client_id_;
-  std::string client_name_;
-  int index_;
-  std::string name_;
-  unsigned int capability_;
-  std::vector<Connection> connections_;
+  struct Slot {
+    alignas(T) unsigned char storage[sizeof(T)];
+    bool live = false;
+    T *get() { return std::launder(reinterpret_cast<T *>(storage)); }
+  };
+  static constexpr size_t block_size = 64;
+  std::vector<std::unique_ptr<Slot[]>> blocks_;
+  size_t block_used_ = 0;
+  std::vector<Slot *> free_;
+};
 
-  void populate_connections() {
-    snd_seq_addr_t addr;
-    addr.client = client_id_;
-    addr.port = index_;
-    snd_seq_query_subscribe_t *subs;
-    snd_seq_query_subscribe_alloca(&subs);
-    snd_seq_query_subscribe_set_root(subs, &addr);
-    snd_seq_query_subscribe_set_type(subs, SND_SEQ_QUERY_SUBS_READ);
-    snd_seq_query_subscribe_set_index(subs, 0);
-    while (snd_seq_query_port_subscribers(seq_, subs) >= 0) {
-      const snd_seq_addr_t *subs_addr;
-      subs_addr = snd_seq_query_subscribe_get_addr(subs);
-      snd_seq_port_info_t *pinfo;
-      snd_seq_port_info_alloca(&pinfo);
-      snd_seq_client_info_t *cinfo;
-      snd_seq_client_info_alloca(&cinfo);
-      snd_seq_get_any_port_info(seq_, subs_addr->client, subs_addr->port,
-                                pinfo);
-      snd_seq_get_any_client_info(seq_, subs_addr->client, cinfo);
-      connections_.push_back({subs_addr->client, subs_addr->port,
-                              snd_seq_client_info_get_name(cinfo),
-                              snd_seq_port_info_get_name(pinfo)});
-      snd_seq_query_subscribe_set_index(
-          subs, snd_seq_query_subscribe_get_index(subs) + 1);
-    }
-  }
+/*
+ * what the sequencer reports about a client, a port or one end of a
+ * subscription. a client name stays valid until the next client query on
+ * the same backend, a port name until the next port query
+ */
+struct ClientInfo {
+  int client;
+  const char *name;
+  snd_seq_client_type type;
 };
 
-class Client {
+struct PortInfo {
+  int port;
+  const char *name;
+  unsigned int capability;
+};
+
+struct SubscriberInfo {
+  snd_seq_addr_t addr;
+  int queue;
+  bool exclusive;
+  bool time_update;
+  bool time_real;
+};
+
+/*
+ * the sequencer operations Seq, Client and Port are built on. AlsaBackend
+ * talks to the kernel, MemoryBackend keeps a synthetic topology in memory
+ * so the rest of the program can be exercised and timed without devices.
+ * everything returns a negative error code on failure, like alsa-lib
+ */
+class Backend {
 public:
-  Client(snd_seq_t *seq, int index, std::string name, snd_seq_client_type type)
-      : seq_(seq), index_(index), name_(name), type_(type) {
-    populate_ports();
-  }
+  virtual ~Backend() = default;
 
-  const int get_index() { return index_; }
+  // a second handle on the same sequencer, nullptr if it can't be opened
+  virtual std::unique_ptr<Backend> open_another() = 0;
 
-  const std::string get_name() { return name_; }
+  virtual int client_id() = 0;
 
-  const snd_seq_client_type get_type() { return type_; }
+  virtual int set_client_name(const char *name) = 0;
 
-  const std::vector<Port *> *get_ports() { return &ports_; };
+  // the first client or port numbered above after, pass -1 to start
+  virtual int next_client(int after, ClientInfo &info) = 0;
 
-  const int get_num_ports() { return ports_.size(); };
+  virtual int next_port(int client, int after, PortInfo &info) = 0;
 
-private:
-  snd_seq_t *seq_;
-  int index_;
-  std::string name_;
-  snd_seq_client_type type_;
-  std::vector<Port *> ports_;
+  virtual int get_client(int client, ClientInfo &info) = 0;
 
-  void populate_ports() {
-    snd_seq_port_info_t *pinfo;
-    snd_seq_port_info_alloca(&pinfo);
-    snd_seq_port_info_set_client(pinfo, index_);
-    snd_seq_port_info_set_port(pinfo, -1);
+  virtual int get_port(int client, int port, PortInfo &info) = 0;
 
-    while (snd_seq_query_next_port(seq_, pinfo) >= 0) {
-      int client_id = index_;
-      int index = snd_seq_port_info_get_port(pinfo);
-      std::string name = snd_seq_port_info_get_name(pinfo);
-      unsigned int capability = snd_seq_port_info_get_capability(pinfo);
-      ports_.push_back(
-          new Port(seq_, client_id, name_, index, name, capability));
-    }
-  };
+  // the index'th port subscribed to root in the direction of type
+  virtual int get_subscriber(const snd_seq_addr_t &root,
+                             snd_seq_query_subs_type_t type, int index,
+                             SubscriberInfo &info) = 0;
+
+  virtual int get_subscription(snd_seq_port_subscribe_t *subs) = 0;
+
+  virtual int subscribe(snd_seq_port_subscribe_t *subs) = 0;
+
+  virtual int unsubscribe(snd_seq_port_subscribe_t *subs) = 0;
+
+  // a private port subscribed to System:Announce, with input nonblocking
+  virtual int open_announce_port() = 0;
+
+  virtual int event_input(snd_seq_event_t **ev) = 0;
+
+  // whether events are waiting, without fetching new ones
+  virtual bool event_pending() = 0;
+
+  // wait up to timeout_ms for input, forever if it is negative
+  virtual int wait_input(int timeout_ms) = 0;
+
+  // a port of this client. events arriving on it are stamped with the real
+  // time of queue, unless that is negative. once there is a port that can
+  // be written to, event_input no longer blocks
+  virtual int create_port(const char *name, unsigned int capability,
+                          int queue) = 0;
+
+  // a queue of this client, already running
+  virtual int open_queue() = 0;
+
+  virtual int queue_time(int queue, snd_seq_real_time_t &time) = 0;
+
+  // deliver ev without going through the output buffer
+  virtual int send_event(snd_seq_event_t *ev) = 0;
+
+  // room for this many events to queue up before input overruns
+  virtual int set_input_size(int events) = 0;
 };
 
-class Seq {
+class AlsaBackend : public Backend {
 public:
-  using Clients = std::vector<Client *>;
-  enum permission : int { LIST_INPUT = 1, LIST_OUTPUT = 2 };
-  // #define SND_SEQ_PORT_CAP_READ		(1<<0)	/**< readable from this
-  // port
-  // */ #define SND_SEQ_PORT_CAP_WRITE		(1<<1)	/**< writable to
-  // this port */
-  //
-  // #define SND_SEQ_PORT_CAP_SYNC_READ	(1<<2)	/**< allow read
-  // subscriptions
-  // */ #define SND_SEQ_PORT_CAP_SYNC_WRITE	(1<<3)	/**< allow write
-  // subscriptions */
-  //
-  // #define SND_SEQ_PORT_CAP_DUPLEX		(1<<4)	/**< allow read/write
-  // duplex
-  // */
-  //
-  // #define SND_SEQ_PORT_CAP_SUBS_READ	(1<<5)	/**< allow read
-  // subscription
-  // */ #define SND_SEQ_PORT_CAP_SUBS_WRITE	(1<<6)	/**< allow write
-  // subscription */
-  // #define SND_SEQ_PORT_CAP_NO_EXPORT	(1<<7)	/**< routing not allowed
-  // */
-
-  Seq() {
-    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+  AlsaBackend() {
+    if (snd_seq_open(&seq_, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
       std::cerr << "can't open sequencer\n";
     }
 
     snd_lib_error_set_handler(error_handler);
-
-    populate_clients();
+    snd_seq_client_info_malloc(&cinfo_);
+    snd_seq_port_info_malloc(&pinfo_);
+    snd_seq_query_subscribe_malloc(&query_);
   }
 
-  ~Seq() { snd_seq_close(seq); }
+  ~AlsaBackend() {
+    snd_seq_query_subscribe_free(query_);
+    snd_seq_port_info_free(pinfo_);
+    snd_seq_client_info_free(cinfo_);
+    snd_seq_close(seq_);
+  }
 
-  void populate_clients() {
-    snd_seq_client_info_t *cinfo;
-    snd_seq_client_info_alloca(&cinfo);
-    snd_seq_client_info_set_client(cinfo, -1);
-    while (snd_seq_query_next_client(seq, cinfo) >= 0) {
-      int index = snd_seq_client_info_get_client(cinfo);
-      std::string name = snd_seq_client_info_get_name(cinfo);
-      snd_seq_client_type type = snd_seq_client_info_get_type(cinfo);
-      clients.push_back(new Client(seq, index, name, type));
+  std::unique_ptr<Backend> open_another() override {
+    snd_seq_t *seq;
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+      return nullptr;
     }
-  };
-
-  std::vector<Client *> *get_clients() { return &clients; }
-
-  Clients::iterator begin() { return clients.begin(); };
+    return std::unique_ptr<Backend>(new AlsaBackend(seq));
+  }
 
-  Clients::iterator end() { return clients.end(); };
+  int client_id() override { return snd_seq_client_id(seq_); }
 
-  void print_list(int list_perm, bool list_subs) {
-    // TODO: reintroduce card info
-    for (auto client : *get_clients()) {
-      // don't print empty clients
-      if (client->get_num_ports() > 0) {
-        std::cout << "client " << client->get_index() << ": '"
-                  << client->get_name() << "' [type="
-                  << (client->get_type() == SND_SEQ_USER_CLIENT ? "user"
-                                                                : "kernel")
-                  << "]\n";
+  int set_client_name(const char *name) override {
+    return snd_seq_set_client_name(seq_, name);
+  }
 
-        for (auto port : *client->get_ports()) {
-          print_port(port);
-          for (auto conn : port->get_connections()) {
-            std::cout << "    -> " << conn.client_id_ << ":" << conn.port_id_
-                      << " (" << conn.client_name_ << ":" << conn.port_name_
-                      << ")\n";
-          }
-          for (auto testport : *client->get_ports()) {
-            for (auto testconn : testport->get_connections()) {
-              if (testconn.client_id_ == port->get_client_id() &&
-                  testconn.port_id_ == port->get_index()) {
-                std::cout << "    <- " << testport->get_client_id() << ":"
-                          << testport->get_index() << " ("
-                          << testport->get_client_name() << ":"
-                          << testport->get_name() << ")\n";
-              }
-            }
-          }
-        }
-      }
+  int next_client(int after, ClientInfo &info) override {
+    snd_seq_client_info_set_client(cinfo_, after);
+    int err = snd_seq_query_next_client(seq_, cinfo_);
+    if (err >= 0) {
+      info = client_info();
     }
+    return err;
   }
 
-  void print_all_ports(int list_perm, bool list_subs) {
-    for (auto client : *get_clients()) {
-      for (auto port : *client->get_ports()) {
-        // std::cout << ":'" << port->get_name() << "'\n";
-        std::cout << client->get_name() << ":" << port->get_name() << "\n";
-      }
+  int next_port(int client, int after, PortInfo &info) override {
+    snd_seq_port_info_set_client(pinfo_, client);
+    snd_seq_port_info_set_port(pinfo_, after);
+    int err = snd_seq_query_next_port(seq_, pinfo_);
+    if (err >= 0) {
+      info = port_info();
     }
+    return err;
   }
 
-  int subscribe(const char *send_address, const char *dest_address,
-                int queue = 0, int exclusive = 0, int convert_time = 0,
-                int convert_real = 0) {
-    snd_seq_port_subscribe_t *subs;
-    snd_seq_port_subscribe_alloca(&subs);
-
-    if (init_subscription(subs, send_address, dest_address, queue, exclusive,
-                          convert_time, convert_real) != 0) {
-      return 1;
+  int get_client(int client, ClientInfo &info) override {
+    int err = snd_seq_get_any_client_info(seq_, client, cinfo_);
+    if (err >= 0) {
+      info = client_info();
     }
+    return err;
+  }
 
-    if (snd_seq_get_port_subscription(seq, subs) == 0) {
-      std::cerr << "connection is already subscribed\n";
-      return 1;
+  int get_port(int client, int port, PortInfo &info) override {
+    int err = snd_seq_get_any_port_info(seq_, client, port, pinfo_);
+    if (err >= 0) {
+      info = port_info();
     }
+    return err;
+  }
 
-    if (snd_seq_subscribe_port(seq, subs) < 0) {
-      std::cerr << "connection failed (" << snd_strerror(errno) << ")\n";
-      return 1;
+  int get_subscriber(const snd_seq_addr_t &root, snd_seq_query_subs_type_t type,
+                     int index, SubscriberInfo &info) override {
+    snd_seq_query_subscribe_set_root(query_, &root);
+    snd_seq_query_subscribe_set_type(query_, type);
+    snd_seq_query_subscribe_set_index(query_, index);
+    int err = snd_seq_query_port_subscribers(seq_, query_);
+    if (err >= 0) {
+      info = {*snd_seq_query_subscribe_get_addr(query_),
+              snd_seq_query_subscribe_get_queue(query_),
+              snd_seq_query_subscribe_get_exclusive(query_) != 0,
+              snd_seq_query_subscribe_get_time_update(query_) != 0,
+              snd_seq_query_subscribe_get_time_real(query_) != 0};
     }
+    return err;
+  }
 
-    return 0;
-  };
+  int get_subscription(snd_seq_port_subscribe_t *subs) override {
+    return snd_seq_get_port_subscription(seq_, subs);
+  }
 
-  int unsubscribe(char *send_address, char *dest_address, int queue = 0,
-                  int exclusive = 0, int convert_time = 0,
-                  int convert_real = 0) {
-    snd_seq_port_subscribe_t *subs;
-    snd_seq_port_subscribe_alloca(&subs);
+  int subscribe(snd_seq_port_subscribe_t *subs) override {
+    return snd_seq_subscribe_port(seq_, subs);
+  }
 
-    if (init_subscription(subs, send_address, dest_address, queue, exclusive,
-                          convert_time, convert_real) != 0) {
-      return 1;
-    }
+  int unsubscribe(snd_seq_port_subscribe_t *subs) override {
+    return snd_seq_unsubscribe_port(seq_, subs);
+  }
 
-    if (snd_seq_get_port_subscription(seq, subs) < 0) {
-      std::cerr << "no subscription is found\n";
-      return 1;
+  int open_announce_port() override {
+    int port = snd_seq_create_simple_port(
+        seq_, "neoaconnect",
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+        SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0) {
+      std::cerr << "can't create port (" << snd_strerror(port) << ")\n";
+      return port;
     }
-
-    if (snd_seq_unsubscribe_port(seq, subs) < 0) {
-      std::cerr << "disconnection failed (" << snd_strerror(errno) << ")\n";
-      return 1;
+    int err = snd_seq_connect_from(seq_, port, SND_SEQ_CLIENT_SYSTEM,
+                                   SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+    if (err < 0) {
+      std::cerr << "can't subscribe to announcements (" << snd_strerror(err)
+                << ")\n";
+      return err;
     }
+    enable_input();
+    return port;
+  }
 
-    return 0;
-  };
+  int event_input(snd_seq_event_t **ev) override {
+    return snd_seq_event_input(seq_, ev);
+  }
 
-  /*
-   * remove all (exported) connections
-   */
-  void remove_connection(Port *p) {
-    snd_seq_port_info_t *pinfo;
-    snd_seq_port_info_alloca(&pinfo);
-    snd_seq_port_info_set_client(pinfo, p->get_client_id());
-    snd_seq_port_info_set_port(pinfo, p->get_index());
-    snd_seq_query_subscribe_t *query;
-    snd_seq_port_info_t *port;
-    snd_seq_port_subscribe_t *subs;
+  bool event_pending() override {
+    return snd_seq_event_input_pending(seq_, 1) > 0;
+  }
 
-    snd_seq_query_subscribe_alloca(&query);
-    snd_seq_query_subscribe_set_root(query, snd_seq_port_info_get_addr(pinfo));
-    snd_seq_query_subscribe_set_type(query, SND_SEQ_QUERY_SUBS_READ);
-    snd_seq_query_subscribe_set_index(query, 0);
+  int wait_input(int timeout_ms) override {
+    if (poll(pfds_.data(), pfds_.size(), timeout_ms) < 0 && errno != EINTR) {
+      return -errno;
+    }
+    return 0;
+  }
 
-    snd_seq_port_info_alloca(&port);
-    snd_seq_port_subscribe_alloca(&subs);
+  int create_port(const char *name, unsigned int capability,
+                  int queue) override {
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca(&info);
+    snd_seq_port_info_set_name(info, name);
+    snd_seq_port_info_set_capability(info, capability);
+    snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_APPLICATION);
+    if (queue >= 0) {
+      snd_seq_port_info_set_timestamping(info, 1);
+      snd_seq_port_info_set_timestamp_real(info, 1);
+      snd_seq_port_info_set_timestamp_queue(info, queue);
+    }
+    int err = snd_seq_create_port(seq_, info);
+    if (err < 0) {
+      return err;
+    }
+    if (capability & SND_SEQ_PORT_CAP_WRITE) {
+      enable_input();
+    }
+    return snd_seq_port_info_get_port(info);
+  }
 
-    while (snd_seq_query_port_subscribers(seq, query) >= 0) {
-      const snd_seq_addr_t *sender = snd_seq_query_subscribe_get_root(query);
-      const snd_seq_addr_t *dest = snd_seq_query_subscribe_get_addr(query);
-
-      if (snd_seq_get_any_port_info(seq, dest->client, dest->port, port) < 0 ||
-          !(snd_seq_port_info_get_capability(port) &
-            SND_SEQ_PORT_CAP_SUBS_WRITE) ||
-          (snd_seq_port_info_get_capability(port) &
-           SND_SEQ_PORT_CAP_NO_EXPORT)) {
-        snd_seq_query_subscribe_set_index(
-            query, snd_seq_query_subscribe_get_index(query) + 1);
-        continue;
-      }
-      snd_seq_port_subscribe_set_queue(
-          subs, snd_seq_query_subscribe_get_queue(query));
-      snd_seq_port_subscribe_set_sender(subs, sender);
-      snd_seq_port_subscribe_set_dest(subs, dest);
-      if (snd_seq_unsubscribe_port(seq, subs) < 0) {
-        snd_seq_query_subscribe_set_index(
-            query, snd_seq_query_subscribe_get_index(query) + 1);
-      }
+  int open_queue() override {
+    int queue = snd_seq_alloc_named_queue(seq_, "neoaconnect");
+    if (queue < 0) {
+      return queue;
     }
+    int err = snd_seq_start_queue(seq_, queue, nullptr);
+    if (err >= 0) {
+      err = snd_seq_drain_output(seq_);
+    }
+    return err < 0 ? err : queue;
   }
 
-  void remove_all_connections() {
-    for (auto client : *get_clients()) {
-      for (auto port : *client->get_ports()) {
-        remove_connection(port);
-      }
+  int queue_time(int queue, snd_seq_real_time_t &time) override {
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca(&status);
+    int err = snd_seq_get_queue_status(seq_, queue, status);
+    if (err >= 0) {
+      time = *snd_seq_queue_status_get_real_time(status);
     }
+    return err;
   }
 
-  void serialize_connections() {
-    auto tbl = toml::table();
+  int send_event(snd_seq_event_t *ev) override {
+    return snd_seq_event_output_direct(seq_, ev);
+  }
 
-    for (auto client : clients) {
-      // auto port_tbl = toml::table();
-      toml::table ports_tbl;
-      for (auto port : *client->get_ports()) {
-        auto connections = port->get_connections();
-        toml::array conn_arr;
-        for (auto conn : connections) {
-          if (conn.port_name_.compare("Network Export") &&
-              conn.port_name_.compare("Announcements")) {
-            conn_arr.push_back(
-                fmt::format("{}:{}", conn.client_name_, conn.port_name_));
-          }
-        }
-        if (!conn_arr.empty()) {
-          ports_tbl.emplace(port->get_name(), conn_arr);
-        }
-      }
-      if (!ports_tbl.empty()) {
-        tbl.emplace(client->get_name(), ports_tbl);
-      }
+  int set_input_size(int events) override {
+    int err = snd_seq_set_client_pool_input(seq_, events);
+    if (err >= 0) {
+      err = snd_seq_set_input_buffer_size(seq_,
+                                          events * sizeof(snd_seq_event_t));
     }
+    return err;
+  }
 
-    std::cout << tbl << "\n";
+private:
+  // reads that don't block and the descriptors wait_input polls, set up
+  // with the first port that events can arrive on
+  void enable_input() {
+    if (!pfds_.empty()) {
+      return;
+    }
+    snd_seq_nonblock(seq_, 1);
+    pfds_.resize(snd_seq_poll_descriptors_count(seq_, POLLIN));
+    snd_seq_poll_descriptors(seq_, pfds_.data(), pfds_.size(), POLLIN);
   }
 
-  void deserialize_connections(char *filename, bool remove_prev = true) {
-    using namespace std::chrono_literals;
+  snd_seq_t *seq_;
+  snd_seq_client_info_t *cinfo_;
+  snd_seq_port_info_t *pinfo_;
+  snd_seq_query_subscribe_t *query_;
+  std::vector<struct pollfd> pfds_;
 
-    toml::table tbl;
-    try {
-      tbl = toml::parse_file(filename);
-      // std::cout << tbl << "\n";
-    } catch (const toml::parse_error &err) {
-      std::cerr << "TOML parsing failed:\n" << err << "\n";
-    }
-    if (remove_prev) {
-      remove_all_connections();
-    }
-    for (auto client : tbl) {
-      auto client_name = std::string(client.first);
-      auto ports = client.second.as_table();
-      for (auto port : *ports) {
-        auto port_name = std::string(port.first);
-        auto connections = port.second.as_array();
-        auto send_addr = fmt::format("{}:{}", client_name, port_name);
-        connections->for_each([&](toml::value<std::string> &elem) {
-          subscribe(send_addr.c_str(), elem->c_str());
-
-          // allow alsa seq to catch up in between subscriptions
-          // std::this_thread::sleep_for(0.5s);
-          snd_seq_port_subscribe_t *subs;
-          snd_seq_port_subscribe_alloca(&subs);
-          auto connected = false;
-          while (connected == false) {
-            if (init_subscription(subs, send_addr.c_str(), elem->c_str()) !=
-                0) {
-              std::cerr << "init subscription failed during "
-                           "deserialize connection check\n";
-            }
+  explicit AlsaBackend(snd_seq_t *seq) : seq_(seq) {
+    snd_seq_client_info_malloc(&cinfo_);
+    snd_seq_port_info_malloc(&pinfo_);
+    snd_seq_query_subscribe_malloc(&query_);
+  }
 
-            if (snd_seq_get_port_subscription(seq, subs) == 0) {
-              connected = true;
-            }
-          }
-        });
-      }
-    };
+  ClientInfo client_info() {
+    return {snd_seq_client_info_get_client(cinfo_),
+            snd_seq_client_info_get_name(cinfo_),
+            snd_seq_client_info_get_type(cinfo_)};
   }
 
-private:
-  snd_seq_t *seq;
-  std::vector<Client *> clients;
+  PortInfo port_info() {
+    return {snd_seq_port_info_get_port(pinfo_),
+            snd_seq_port_info_get_name(pinfo_),
+            snd_seq_port_info_get_capability(pinfo_)};
+  }
 
   static void error_handler(const char *file, int line, const char *function,
                             int err, const char *fmt, ...) {
@@ -421,150 +468,5156 @@ private:
     putc('\n', stderr);
     va_end(arg);
   }
+};
 
-  int parse_address(snd_seq_addr_t *addr, const std::string arg) {
-    std::string arg_client_name, arg_port_name;
-    Client *client;
-    Port *port;
-    int arg_client_id = -1;
-    int arg_port_id = -1;
+/*
+ * a sequencer that only exists in memory, holding a System client and a
+ * synthetic topology of clients with ports_per_client ports each, every
+ * port subscribed to up to edges_per_port others. the topology is generated
+ * from a fixed seed, so every run sees the same names and connections.
+ * handles opened with open_another() share it and see each other's
+ * announcements, the same as on a real sequencer
+ */
+class MemoryBackend : public Backend {
+public:
+  // user clients are numbered from here, like on a real sequencer
+  static constexpr int first_user_client = 128;
+  static constexpr int max_clients = first_user_client - 16;
+  static constexpr int max_ports = 254;
+
+  MemoryBackend(int clients, int ports_per_client, int edges_per_port)
+      : world_(std::make_shared<World>()) {
+    auto &system = world_->clients[SND_SEQ_CLIENT_SYSTEM];
+    system = {"System", SND_SEQ_KERNEL_CLIENT, {}};
+    system.ports[SND_SEQ_PORT_SYSTEM_TIMER] = {"Timer", 0x63, {}, {}};
+    system.ports[SND_SEQ_PORT_SYSTEM_ANNOUNCE] = {"Announce", 0x21, {}, {}};
+
+    unsigned int caps = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_WRITE |
+                        SND_SEQ_PORT_CAP_SUBS_READ |
+                        SND_SEQ_PORT_CAP_SUBS_WRITE;
+    for (int c = 0; c < clients; c++) {
+      auto &client = world_->clients[16 + c];
+      client = {fmt::format("Synth {}", c), SND_SEQ_USER_CLIENT, {}};
+      for (int p = 0; p < ports_per_client; p++) {
+        client.ports[p] = {fmt::format("Synth {} Port {}", c, p), caps, {}, {}};
+      }
+    }
+
+    // a small LCG keeps the edges the same from run to run
+    uint32_t state = 1;
+    auto random = [&](int n) {
+      state = state * 1664525 + 1013904223;
+      return (int)((state >> 8) % n);
+    };
+    for (int c = 0; c < clients && ports_per_client > 0; c++) {
+      for (int p = 0; p < ports_per_client; p++) {
+        for (int e = 0; e < edges_per_port; e++) {
+          snd_seq_addr_t sender = {(unsigned char)(16 + c), (unsigned char)p};
+          snd_seq_addr_t dest = {(unsigned char)(16 + random(clients)),
+                                 (unsigned char)random(ports_per_client)};
+          // self loops and repeats are skipped, so E is an upper bound
+          if (dest.client != sender.client || dest.port != sender.port) {
+            connect(sender, dest, 0, false, false, false);
+          }
+        }
+      }
+    }
+    attach();
+  }
+
+  ~MemoryBackend() {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto &clients = world_->clients;
+    for (auto &[client_id, client] : clients) {
+      for (auto &[port_id, port] : client.ports) {
+        for (auto subs : {&port.readers, &port.writers}) {
+          subs->erase(std::remove_if(subs->begin(), subs->end(),
+                                     [&](const SubscriberInfo &sub) {
+                                       return sub.addr.client == client_id_;
+                                     }),
+                      subs->end());
+        }
+      }
+    }
+    clients.erase(client_id_);
+    auto &handles = world_->handles;
+    handles.erase(std::find(handles.begin(), handles.end(), this));
+    announce(SND_SEQ_EVENT_CLIENT_EXIT, {(unsigned char)client_id_, 0});
+  }
+
+  /*
+   * make every query, subscription and unsubscription on any handle take
+   * this much longer, as a call into the kernel would. the topology is not
+   * locked meanwhile, so calls from several handles overlap
+   */
+  void set_latency(std::chrono::nanoseconds latency) {
+    world_->latency_ns = latency.count();
+  }
+
+  std::unique_ptr<Backend> open_another() override {
+    return std::unique_ptr<Backend>(new MemoryBackend(world_));
+  }
+
+  int client_id() override { return client_id_; }
+
+  int set_client_name(const char *name) override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    world_->clients[client_id_].name = name;
+    announce(SND_SEQ_EVENT_CLIENT_CHANGE, {(unsigned char)client_id_, 0});
+    return 0;
+  }
+
+  int next_client(int after, ClientInfo &info) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto it = world_->clients.upper_bound(after);
+    if (it == world_->clients.end()) {
+      return -ENOENT;
+    }
+    info = {it->first, it->second.name.c_str(), it->second.type};
+    return 0;
+  }
+
+  int next_port(int client, int after, PortInfo &info) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto client_it = world_->clients.find(client);
+    if (client_it == world_->clients.end()) {
+      return -ENOENT;
+    }
+    auto it = client_it->second.ports.upper_bound(after);
+    if (it == client_it->second.ports.end()) {
+      return -ENOENT;
+    }
+    info = {it->first, it->second.name.c_str(), it->second.capability};
+    return 0;
+  }
+
+  int get_client(int client, ClientInfo &info) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto it = world_->clients.find(client);
+    if (it == world_->clients.end()) {
+      return -ENOENT;
+    }
+    info = {it->first, it->second.name.c_str(), it->second.type};
+    return 0;
+  }
+
+  int get_port(int client, int port, PortInfo &info) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto entry = find_port(client, port);
+    if (entry == nullptr) {
+      return -ENOENT;
+    }
+    info = {port, entry->name.c_str(), entry->capability};
+    return 0;
+  }
+
+  int get_subscriber(const snd_seq_addr_t &root, snd_seq_query_subs_type_t type,
+                     int index, SubscriberInfo &info) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto port = find_port(root.client, root.port);
+    if (port == nullptr) {
+      return -ENOENT;
+    }
+    auto &subs = type == SND_SEQ_QUERY_SUBS_READ ? port->readers : port->writers;
+    if (index < 0 || index >= (int)subs.size()) {
+      return -ENOENT;
+    }
+    info = subs[index];
+    return 0;
+  }
+
+  int get_subscription(snd_seq_port_subscribe_t *subs) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto sender = snd_seq_port_subscribe_get_sender(subs);
+    auto port = find_port(sender->client, sender->port);
+    if (port == nullptr) {
+      return -ENOENT;
+    }
+    auto sub =
+        find_subscriber(port->readers, *snd_seq_port_subscribe_get_dest(subs));
+    if (sub == port->readers.end()) {
+      return -ENOENT;
+    }
+    snd_seq_port_subscribe_set_queue(subs, sub->queue);
+    snd_seq_port_subscribe_set_exclusive(subs, sub->exclusive);
+    snd_seq_port_subscribe_set_time_update(subs, sub->time_update);
+    snd_seq_port_subscribe_set_time_real(subs, sub->time_real);
+    return 0;
+  }
+
+  int subscribe(snd_seq_port_subscribe_t *subs) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    return connect(*snd_seq_port_subscribe_get_sender(subs),
+                   *snd_seq_port_subscribe_get_dest(subs),
+                   snd_seq_port_subscribe_get_queue(subs),
+                   snd_seq_port_subscribe_get_exclusive(subs),
+                   snd_seq_port_subscribe_get_time_update(subs),
+                   snd_seq_port_subscribe_get_time_real(subs));
+  }
+
+  int unsubscribe(snd_seq_port_subscribe_t *subs) override {
+    delay();
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto &sender = *snd_seq_port_subscribe_get_sender(subs);
+    auto &dest = *snd_seq_port_subscribe_get_dest(subs);
+    auto sender_port = find_port(sender.client, sender.port);
+    auto dest_port = find_port(dest.client, dest.port);
+    if (sender_port == nullptr || dest_port == nullptr) {
+      return -ENOENT;
+    }
+    auto reader = find_subscriber(sender_port->readers, dest);
+    if (reader == sender_port->readers.end()) {
+      return -ENOENT;
+    }
+    sender_port->readers.erase(reader);
+    dest_port->writers.erase(find_subscriber(dest_port->writers, sender));
+    announce_connect(SND_SEQ_EVENT_PORT_UNSUBSCRIBED, sender, dest);
+    return 0;
+  }
+
+  int open_announce_port() override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto &ports = world_->clients[client_id_].ports;
+    int port = ports.empty() ? 0 : ports.rbegin()->first + 1;
+    ports[port] = {"neoaconnect",
+                   SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+                   {},
+                   {}};
+    listening_ = true;
+    announce(SND_SEQ_EVENT_PORT_START,
+             {(unsigned char)client_id_, (unsigned char)port});
+    connect({SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE},
+            {(unsigned char)client_id_, (unsigned char)port}, 0, false, false,
+            false);
+    return port;
+  }
+
+  int event_input(snd_seq_event_t **ev) override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    if (events_.empty()) {
+      return -EAGAIN;
+    }
+    current_ = events_.front();
+    events_.pop_front();
+    *ev = &current_;
+    return events_.size();
+  }
+
+  bool event_pending() override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    return !events_.empty();
+  }
+
+  int wait_input(int timeout_ms) override {
+    std::unique_lock<std::mutex> lock(world_->lock);
+    auto ready = [&] { return !events_.empty(); };
+    if (timeout_ms < 0) {
+      world_->input.wait(lock, ready);
+    } else {
+      world_->input.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                             ready);
+    }
+    return 0;
+  }
+
+  int create_port(const char *name, unsigned int capability,
+                  int queue) override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto &ports = world_->clients[client_id_].ports;
+    int port = ports.empty() ? 0 : ports.rbegin()->first + 1;
+    ports[port] = {name, capability, {}, {}, queue};
+    announce(SND_SEQ_EVENT_PORT_START,
+             {(unsigned char)client_id_, (unsigned char)port});
+    return port;
+  }
+
+  int open_queue() override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    world_->queues.push_back(std::chrono::steady_clock::now());
+    return world_->queues.size() - 1;
+  }
+
+  int queue_time(int queue, snd_seq_real_time_t &time) override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    if (queue < 0 || queue >= (int)world_->queues.size()) {
+      return -EINVAL;
+    }
+    time = elapsed(queue);
+    return 0;
+  }
+
+  // only to the subscribers of the source port, which is all a synthetic
+  // sequencer needs. the synthetic clients have nothing behind their ports,
+  // so only other handles receive anything
+  int send_event(snd_seq_event_t *ev) override {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto port = find_port(client_id_, ev->source.port);
+    if (port == nullptr) {
+      return -EINVAL;
+    }
+    snd_seq_event_t delivered = *ev;
+    delivered.source.client = client_id_;
+    for (auto &sub : port->readers) {
+      auto dest_port = find_port(sub.addr.client, sub.addr.port);
+      auto handle = std::find_if(
+          world_->handles.begin(), world_->handles.end(),
+          [&](MemoryBackend *h) { return h->client_id_ == sub.addr.client; });
+      if (dest_port == nullptr || handle == world_->handles.end()) {
+        continue;
+      }
+      delivered.dest = sub.addr;
+      if (dest_port->timestamp_queue >= 0) {
+        delivered.time.time = elapsed(dest_port->timestamp_queue);
+      }
+      (*handle)->events_.push_back(delivered);
+    }
+    world_->input.notify_all();
+    return 0;
+  }
+
+  // events queue up without limit
+  int set_input_size(int) override { return 0; }
+
+private:
+  struct PortEntry {
+    std::string name;
+    unsigned int capability;
+    // ports this one sends to, and ports sending to it
+    std::vector<SubscriberInfo> readers;
+    std::vector<SubscriberInfo> writers;
+    // the queue whose real time arriving events are stamped with, or -1
+    int timestamp_queue = -1;
+  };
+
+  struct ClientEntry {
+    std::string name;
+    snd_seq_client_type type;
+    std::map<int, PortEntry> ports;
+  };
+
+  struct World {
+    std::mutex lock;
+    std::condition_variable input;
+    std::map<int, ClientEntry> clients;
+    std::vector<MemoryBackend *> handles;
+    // when each queue was started
+    std::vector<std::chrono::steady_clock::time_point> queues;
+    std::atomic<long> latency_ns{0};
+  };
+
+  std::shared_ptr<World> world_;
+  int client_id_ = -1;
+  bool listening_ = false;
+  std::deque<snd_seq_event_t> events_;
+  snd_seq_event_t current_;
+
+  explicit MemoryBackend(std::shared_ptr<World> world)
+      : world_(std::move(world)) {
+    attach();
+  }
+
+  // register this handle as a client of its own
+  void attach() {
+    std::lock_guard<std::mutex> lock(world_->lock);
+    auto &clients = world_->clients;
+    client_id_ = first_user_client;
+    while (clients.count(client_id_)) {
+      client_id_++;
+    }
+    clients[client_id_] = {fmt::format("Client-{}", client_id_),
+                           SND_SEQ_USER_CLIENT,
+                           {}};
+    world_->handles.push_back(this);
+    announce(SND_SEQ_EVENT_CLIENT_START, {(unsigned char)client_id_, 0});
+  }
+
+  // the time set with set_latency, taken without the world lock held
+  void delay() {
+    long ns = world_->latency_ns.load(std::memory_order_relaxed);
+    if (ns > 0) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+    }
+  }
+
+  // the world lock must be held
+  snd_seq_real_time_t elapsed(int queue) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - world_->queues[queue])
+                  .count();
+    return {(unsigned int)(ns / 1000000000), (unsigned int)(ns % 1000000000)};
+  }
+
+  PortEntry *find_port(int client, int port) {
+    auto client_it = world_->clients.find(client);
+    if (client_it == world_->clients.end()) {
+      return nullptr;
+    }
+    auto it = client_it->second.ports.find(port);
+    return it != client_it->second.ports.end() ? &it->second : nullptr;
+  }
+
+  static std::vector<SubscriberInfo>::iterator
+  find_subscriber(std::vector<SubscriberInfo> &subs,
+                  const snd_seq_addr_t &addr) {
+    return std::find_if(subs.begin(), subs.end(), [&](const SubscriberInfo &sub) {
+      return sub.addr.client == addr.client && sub.addr.port == addr.port;
+    });
+  }
+
+  // the world lock must be held
+  int connect(const snd_seq_addr_t &sender, const snd_seq_addr_t &dest,
+              int queue, bool exclusive, bool time_update, bool time_real) {
+    auto sender_port = find_port(sender.client, sender.port);
+    auto dest_port = find_port(dest.client, dest.port);
+    if (sender_port == nullptr || dest_port == nullptr) {
+      return -ENOENT;
+    }
+    if (find_subscriber(sender_port->readers, dest) !=
+        sender_port->readers.end()) {
+      return -EBUSY;
+    }
+    // as in the kernel, an exclusive connection has to be the only one out
+    // of its sender and the only one into its destination
+    for (auto subs : {&sender_port->readers, &dest_port->writers}) {
+      if (!subs->empty() && (exclusive || subs->front().exclusive)) {
+        return -EBUSY;
+      }
+    }
+    sender_port->readers.push_back(
+        {dest, queue, exclusive, time_update, time_real});
+    dest_port->writers.push_back(
+        {sender, queue, exclusive, time_update, time_real});
+    announce_connect(SND_SEQ_EVENT_PORT_SUBSCRIBED, sender, dest);
+    return 0;
+  }
+
+  // the world lock must be held
+  void announce(snd_seq_event_type_t type, const snd_seq_addr_t &addr) {
+    snd_seq_event_t ev = {};
+    ev.type = type;
+    ev.data.addr = addr;
+    broadcast(ev);
+  }
+
+  void announce_connect(snd_seq_event_type_t type, const snd_seq_addr_t &sender,
+                        const snd_seq_addr_t &dest) {
+    snd_seq_event_t ev = {};
+    ev.type = type;
+    ev.data.connect.sender = sender;
+    ev.data.connect.dest = dest;
+    broadcast(ev);
+  }
+
+  void broadcast(snd_seq_event_t &ev) {
+    ev.source.client = SND_SEQ_CLIENT_SYSTEM;
+    ev.source.port = SND_SEQ_PORT_SYSTEM_ANNOUNCE;
+    for (auto handle : world_->handles) {
+      if (handle->listening_) {
+        handle->events_.push_back(ev);
+      }
+    }
+    world_->input.notify_all();
+  }
+};
+
+/*
+ * wall time per phase and the number of sequencer calls of each kind,
+ * collected for --stats and --trace. phases may be recorded from several
+ * threads and may nest
+ */
+class Trace {
+public:
+  enum call : int {
+    QUERY_NEXT_CLIENT,
+    QUERY_NEXT_PORT,
+    QUERY_PORT_SUBSCRIBERS,
+    GET_ANY_CLIENT_INFO,
+    GET_ANY_PORT_INFO,
+    GET_PORT_SUBSCRIPTION,
+    SUBSCRIBE_PORT,
+    UNSUBSCRIBE_PORT,
+    EVENT_INPUT,
+    WAIT_INPUT,
+    NUM_CALLS
+  };
+
+  // what a PortFilter kept from being looked at
+  enum filtered : int { FILTERED_CLIENTS, FILTERED_PORTS, NUM_FILTERED };
+
+  /*
+   * records the time from its construction to its destruction as a span
+   * of the given name. does nothing if trace is nullptr
+   */
+  class Scope {
+  public:
+    Scope(Trace *trace, const char *name, int thread = 0)
+        : trace_(trace), name_(name), thread_(thread),
+          start_(std::chrono::steady_clock::now()) {}
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() {
+      if (trace_ != nullptr) {
+        trace_->record(name_, start_, thread_);
+      }
+    }
+
+  private:
+    Trace *trace_;
+    const char *name_;
+    int thread_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  void count(call c) { calls_[c].fetch_add(1, std::memory_order_relaxed); }
+
+  void count(filtered f) {
+    filtered_[f].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // the calls of one kind counted so far
+  long calls(call c) { return calls_[c].load(); }
+
+  void record(const char *name, std::chrono::steady_clock::time_point start,
+              int thread) {
+    auto end = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(lock_);
+    spans_.push_back({name, micros(start), micros(end) - micros(start), thread});
+  }
+
+  // per phase totals and call counts, on stderr
+  void print_stats() {
+    std::lock_guard<std::mutex> lock(lock_);
+    std::vector<std::pair<const char *, std::pair<int, int64_t>>> phases;
+    for (auto &span : spans_) {
+      auto it = std::find_if(phases.begin(), phases.end(), [&](auto &phase) {
+        return strcmp(phase.first, span.name) == 0;
+      });
+      if (it == phases.end()) {
+        phases.push_back({span.name, {0, 0}});
+        it = phases.end() - 1;
+      }
+      it->second.first++;
+      it->second.second += span.duration_us;
+    }
+    std::string text = fmt::format("{:<24} {:>8} {:>12}\n", "phase", "count",
+                                   "total ms");
+    for (auto &[name, totals] : phases) {
+      text += fmt::format("{:<24} {:>8} {:>12.3f}\n", name, totals.first,
+                          totals.second / 1000.0);
+    }
+    text += fmt::format("{:<24} {:>8}\n", "sequencer call", "count");
+    for (int i = 0; i < NUM_CALLS; i++) {
+      text += fmt::format("{:<24} {:>8}\n", call_names[i], calls_[i].load());
+    }
+    if (filtered_[FILTERED_CLIENTS] > 0 || filtered_[FILTERED_PORTS] > 0) {
+      text += fmt::format("{:<24} {:>8}\n", "filtered out", "count");
+      for (int i = 0; i < NUM_FILTERED; i++) {
+        text += fmt::format("{:<24} {:>8}\n", filtered_names[i],
+                            filtered_[i].load());
+      }
+    }
+    std::cerr << text;
+  }
+
+  // the spans as complete events in the Chrome trace event format
+  int write_chrome_trace(const char *filename) {
+    std::lock_guard<std::mutex> lock(lock_);
+    std::ofstream file(filename);
+    if (!file) {
+      std::cerr << "can't write trace to '" << filename << "'\n";
+      return 1;
+    }
+    file << "{\"traceEvents\":[";
+    bool first = true;
+    for (auto &span : spans_) {
+      file << fmt::format("{}\n{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{},"
+                          "\"dur\":{},\"pid\":1,\"tid\":{}}}",
+                          first ? "" : ",", span.name, span.start_us,
+                          span.duration_us, span.thread);
+      first = false;
+    }
+    file << fmt::format("{}\n{{\"name\":\"sequencer calls\",\"ph\":\"C\","
+                        "\"ts\":{},\"pid\":1,\"args\":{{",
+                        first ? "" : ",", micros(std::chrono::steady_clock::now()));
+    for (int i = 0; i < NUM_CALLS; i++) {
+      file << fmt::format("{}\"{}\":{}", i ? "," : "", call_names[i],
+                          calls_[i].load());
+    }
+    for (int i = 0; i < NUM_FILTERED; i++) {
+      file << fmt::format(",\"filtered_{}\":{}", filtered_names[i],
+                          filtered_[i].load());
+    }
+    file << "}}\n]}\n";
+    return file.good() ? 0 : 1;
+  }
+
+private:
+  struct Span {
+    const char *name;
+    int64_t start_us;
+    int64_t duration_us;
+    int thread;
+  };
+
+  static constexpr const char *call_names[NUM_CALLS] = {
+      "query_next_client",     "query_next_port",   "query_port_subscribers",
+      "get_any_client_info",   "get_any_port_info", "get_port_subscription",
+      "subscribe_port",        "unsubscribe_port",  "event_input",
+      "wait_input"};
+  static constexpr const char *filtered_names[NUM_FILTERED] = {"clients",
+                                                               "ports"};
+
+  std::chrono::steady_clock::time_point origin_ =
+      std::chrono::steady_clock::now();
+  std::mutex lock_;
+  std::vector<Span> spans_;
+  std::atomic<long> calls_[NUM_CALLS] = {};
+  std::atomic<long> filtered_[NUM_FILTERED] = {};
+
+  int64_t micros(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - origin_)
+        .count();
+  }
+};
+
+/*
+ * counts the calls made to another backend, for --stats and --trace
+ */
+class CountingBackend : public Backend {
+public:
+  CountingBackend(std::unique_ptr<Backend> backend, Trace *trace)
+      : backend_(std::move(backend)), trace_(trace) {}
+
+  std::unique_ptr<Backend> open_another() override {
+    auto other = backend_->open_another();
+    if (other == nullptr) {
+      return nullptr;
+    }
+    return std::make_unique<CountingBackend>(std::move(other), trace_);
+  }
+
+  int client_id() override { return backend_->client_id(); }
+
+  int set_client_name(const char *name) override {
+    return backend_->set_client_name(name);
+  }
+
+  int next_client(int after, ClientInfo &info) override {
+    trace_->count(Trace::QUERY_NEXT_CLIENT);
+    return backend_->next_client(after, info);
+  }
+
+  int next_port(int client, int after, PortInfo &info) override {
+    trace_->count(Trace::QUERY_NEXT_PORT);
+    return backend_->next_port(client, after, info);
+  }
+
+  int get_client(int client, ClientInfo &info) override {
+    trace_->count(Trace::GET_ANY_CLIENT_INFO);
+    return backend_->get_client(client, info);
+  }
+
+  int get_port(int client, int port, PortInfo &info) override {
+    trace_->count(Trace::GET_ANY_PORT_INFO);
+    return backend_->get_port(client, port, info);
+  }
+
+  int get_subscriber(const snd_seq_addr_t &root, snd_seq_query_subs_type_t type,
+                     int index, SubscriberInfo &info) override {
+    trace_->count(Trace::QUERY_PORT_SUBSCRIBERS);
+    return backend_->get_subscriber(root, type, index, info);
+  }
+
+  int get_subscription(snd_seq_port_subscribe_t *subs) override {
+    trace_->count(Trace::GET_PORT_SUBSCRIPTION);
+    return backend_->get_subscription(subs);
+  }
+
+  int subscribe(snd_seq_port_subscribe_t *subs) override {
+    trace_->count(Trace::SUBSCRIBE_PORT);
+    return backend_->subscribe(subs);
+  }
+
+  int unsubscribe(snd_seq_port_subscribe_t *subs) override {
+    trace_->count(Trace::UNSUBSCRIBE_PORT);
+    return backend_->unsubscribe(subs);
+  }
+
+  int open_announce_port() override { return backend_->open_announce_port(); }
+
+  int event_input(snd_seq_event_t **ev) override {
+    trace_->count(Trace::EVENT_INPUT);
+    return backend_->event_input(ev);
+  }
+
+  bool event_pending() override { return backend_->event_pending(); }
+
+  int wait_input(int timeout_ms) override {
+    trace_->count(Trace::WAIT_INPUT);
+    return backend_->wait_input(timeout_ms);
+  }
+
+  int create_port(const char *name, unsigned int capability,
+                  int queue) override {
+    return backend_->create_port(name, capability, queue);
+  }
+
+  int open_queue() override { return backend_->open_queue(); }
+
+  int queue_time(int queue, snd_seq_real_time_t &time) override {
+    return backend_->queue_time(queue, time);
+  }
+
+  int send_event(snd_seq_event_t *ev) override {
+    return backend_->send_event(ev);
+  }
+
+  int set_input_size(int events) override {
+    return backend_->set_input_size(events);
+  }
+
+private:
+  std::unique_ptr<Backend> backend_;
+  Trace *trace_;
+};
+
+/*
+ * which clients and ports a listing is about. the rest are dropped while
+ * the topology is loaded, so nothing is ever queried about them
+ */
+struct PortFilter {
+  bool input = false;    // readable ports open to subscription
+  bool output = false;   // writable ports open to subscription
+  bool exported = false; // leave out NO_EXPORT ports
+  int client_type = -1;  // SND_SEQ_KERNEL_CLIENT or SND_SEQ_USER_CLIENT
+  Trace *trace = nullptr;
+
+  bool active() const {
+    return input || output || exported || client_type >= 0;
+  }
+
+  // whether anything has been dropped yet, by any scan thread
+  bool dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  bool accepts_client(snd_seq_client_type type) const {
+    if (client_type >= 0 && type != client_type) {
+      drop(Trace::FILTERED_CLIENTS);
+      return false;
+    }
+    return true;
+  }
+
+  // -i and -o together keep ports that are either
+  bool accepts_port(unsigned int capability) const {
+    unsigned int read = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+    unsigned int write = SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+    if (((input || output) && !(input && (capability & read) == read) &&
+         !(output && (capability & write) == write)) ||
+        (exported && (capability & SND_SEQ_PORT_CAP_NO_EXPORT))) {
+      drop(Trace::FILTERED_PORTS);
+      return false;
+    }
+    return true;
+  }
+
+private:
+  mutable std::atomic<bool> dropped_{false};
+
+  void drop(Trace::filtered what) const {
+    dropped_.store(true, std::memory_order_relaxed);
+    if (trace != nullptr) {
+      trace->count(what);
+    }
+  }
+};
+
+/*
+ * names are views into the NamePool of the Seq the connection came from.
+ * announcements don't carry the subscription attributes, so connections
+ * learnt from them keep the defaults
+ */
+struct Connection {
+  int client_id_;
+  int port_id_;
+  std::string_view client_name_;
+  std::string_view port_name_;
+  int queue_ = 0;
+  bool exclusive_ = false;
+  bool time_update_ = false;
+  bool time_real_ = false;
+};
+
+/*
+ * call f(index, name, capability) for every port of a client
+ */
+template <typename F> void query_ports(Backend &backend, int client_id, F f) {
+  PortInfo info;
+  for (int port = -1;
+       backend.next_port(client_id, port, info) >= 0; port = info.port) {
+    f(info.port, info.name, info.capability);
+  }
+}
+
+/*
+ * call f(subscriber) for every port subscribed to the given one, or with
+ * SND_SEQ_QUERY_SUBS_WRITE every port it is subscribed to. only the
+ * addresses are reported, see NameLookup for their names
+ */
+template <typename F>
+void query_subscribers(Backend &backend, int client_id, int port_id, F f,
+                       snd_seq_query_subs_type_t type = SND_SEQ_QUERY_SUBS_READ) {
+  snd_seq_addr_t addr;
+  addr.client = client_id;
+  addr.port = port_id;
+  SubscriberInfo sub;
+  for (int index = 0; backend.get_subscriber(addr, type, index, sub) >= 0;
+       index++) {
+    f(sub);
+  }
+}
+
+/*
+ * the names of the other end of a subscription, taken from the clients and
+ * ports that have been enumerated anyway rather than asked for edge by
+ * edge. implemented by Seq
+ */
+class NameLookup {
+public:
+  virtual ~NameLookup() = default;
+
+  // false if the port is not in the topology, e.g. because it has gone
+  virtual bool find_names(int client_id, int port_id,
+                          std::string_view &client_name,
+                          std::string_view &port_name) = 0;
+};
+
+/*
+ * what a scan worker found out about a port on its own handle, before it
+ * is merged into the topology
+ */
+struct ScannedPort {
+  int index;
+  std::string name;
+  unsigned int capability;
+  std::vector<SubscriberInfo> connections;
+  bool connections_scanned;
+  // only queried for filtered listings, see Seq::index_inbound
+  std::vector<SubscriberInfo> inbound;
+  bool inbound_scanned;
+};
+
+class Port {
+public:
+  Port(Backend *backend, NamePool *names, NameLookup *lookup, int client_id,
+       std::string_view client_name, int index, std::string_view name,
+       unsigned int capability)
+      : backend_(backend), names_(names), lookup_(lookup),
+        client_id_(client_id), client_name_(client_name), index_(index),
+        name_(name), capability_(capability) {}
+
+  const int get_client_id() { return client_id_; }
+
+  std::string_view get_client_name() { return client_name_; }
+
+  const int get_index() { return index_; }
+
+  std::string_view get_name() { return name_; }
+
+  unsigned int get_capability() { return capability_; }
+
+  // names must already be interned
+  void set_client_name(std::string_view client_name) {
+    client_name_ = client_name;
+  }
+
+  void set_name(std::string_view name) { name_ = name; }
+
+  void set_capability(unsigned int capability) { capability_ = capability; }
+
+  // subscribers are only queried the first time they are asked for
+  const std::vector<Connection> &get_connections() {
+    if (!connections_loaded_) {
+      populate_connections();
+    }
+    return connections_;
+  }
+
+  bool has_connections_loaded() { return connections_loaded_; }
+
+  // take over subscribers queried elsewhere, by Seq::scan
+  void load_connections(const std::vector<SubscriberInfo> &edges) {
+    connections_loaded_ = true;
+    load_edges(edges, connections_);
+  }
+
+  // ports this one is subscribed to, filled in by Seq::index_inbound
+  const std::vector<Connection> &get_inbound() { return inbound_; }
+
+  bool has_inbound_loaded() { return inbound_loaded_; }
+
+  void clear_inbound() {
+    inbound_.clear();
+    inbound_loaded_ = false;
+  }
+
+  // conn is the sender's connection to this port
+  void add_inbound(Port *sender, const Connection &conn) {
+    inbound_.push_back({sender->get_client_id(), sender->get_index(),
+                        sender->get_client_name(), sender->get_name(),
+                        conn.queue_, conn.exclusive_, conn.time_update_,
+                        conn.time_real_});
+  }
+
+  void load_inbound(const std::vector<SubscriberInfo> &edges) {
+    inbound_loaded_ = true;
+    load_edges(edges, inbound_);
+  }
+
+  /*
+   * ask the sequencer for the senders instead of collecting them from
+   * their connections, for when not every sender has been loaded
+   */
+  void query_inbound() {
+    inbound_loaded_ = true;
+    inbound_.clear();
+    query_subscribers(
+        *backend_, client_id_, index_,
+        [&](const SubscriberInfo &sub) { add_edge(sub, inbound_); },
+        SND_SEQ_QUERY_SUBS_WRITE);
+    name_edges(inbound_);
+  }
+
+  /*
+   * keep already queried subscribers in step with announcements. a port
+   * that has not been queried yet will see the change when it is
+   */
+  void add_connection(const Connection &conn) {
+    if (connections_loaded_ && find_connection(conn.client_id_, conn.port_id_) ==
+                                   connections_.end()) {
+      connections_.push_back(conn);
+    }
+  }
+
+  // a port_id of -1 removes the connections to every port of the client
+  void remove_connections(int client_id, int port_id) {
+    connections_.erase(
+        std::remove_if(connections_.begin(), connections_.end(),
+                       [&](const Connection &conn) {
+                         return conn.client_id_ == client_id &&
+                                (port_id < 0 || conn.port_id_ == port_id);
+                       }),
+        connections_.end());
+  }
+
+  void rename_connections(int client_id, std::string_view client_name) {
+    for (auto &conn : connections_) {
+      if (conn.client_id_ == client_id) {
+        conn.client_name_ = client_name;
+      }
+    }
+  }
+
+  void rename_connection(int client_id, int port_id,
+                         std::string_view port_name) {
+    auto it = find_connection(client_id, port_id);
+    if (it != connections_.end()) {
+      it->port_name_ = port_name;
+    }
+  }
+
+private:
+  Backend *backend_;
+  NamePool *names_;
+  NameLookup *lookup_;
+  int client_id_;
+  std::string_view client_name_;
+  int index_;
+  std::string_view name_;
+  unsigned int capability_;
+  std::vector<Connection> connections_;
+  bool connections_loaded_ = false;
+  std::vector<Connection> inbound_;
+  bool inbound_loaded_ = false;
+
+  void load_edges(const std::vector<SubscriberInfo> &edges,
+                  std::vector<Connection> &out) {
+    out.clear();
+    out.reserve(edges.size());
+    for (auto &edge : edges) {
+      add_edge(edge, out);
+    }
+    name_edges(out);
+  }
+
+  // without names, those are filled in by name_edges
+  static void add_edge(const SubscriberInfo &sub, std::vector<Connection> &out) {
+    out.push_back({sub.addr.client, sub.addr.port, {}, {}, sub.queue,
+                   sub.exclusive, sub.time_update, sub.time_real});
+  }
+
+  /*
+   * only ports missing from the topology, because they went away after
+   * their client was enumerated or were left out by a filter, cost two
+   * more sequencer calls each
+   */
+  void name_edges(std::vector<Connection> &edges) {
+    for (auto &conn : edges) {
+      if (lookup_->find_names(conn.client_id_, conn.port_id_,
+                              conn.client_name_, conn.port_name_)) {
+        continue;
+      }
+      PortInfo pinfo = {conn.port_id_, "", 0};
+      backend_->get_port(conn.client_id_, conn.port_id_, pinfo);
+      ClientInfo cinfo = {conn.client_id_, "", SND_SEQ_USER_CLIENT};
+      backend_->get_client(conn.client_id_, cinfo);
+      conn.client_name_ = names_->intern(cinfo.name);
+      conn.port_name_ = names_->intern(pinfo.name);
+    }
+  }
+
+  std::vector<Connection>::iterator find_connection(int client_id,
+                                                    int port_id) {
+    return std::find_if(connections_.begin(), connections_.end(),
+                        [&](const Connection &conn) {
+                          return conn.client_id_ == client_id &&
+                                 conn.port_id_ == port_id;
+                        });
+  }
+
+  // the addresses first, then their names from the topology
+  void populate_connections() {
+    connections_loaded_ = true;
+    query_subscribers(
+        *backend_, client_id_, index_,
+        [&](const SubscriberInfo &sub) { add_edge(sub, connections_); });
+    name_edges(connections_);
+  }
+};
+
+class Client {
+public:
+  Client(Backend *backend, NamePool *names, NameLookup *lookup,
+         ObjectPool<Port> *port_pool, const PortFilter *filter, int index,
+         std::string_view name, snd_seq_client_type type)
+      : backend_(backend), names_(names), lookup_(lookup),
+        port_pool_(port_pool), filter_(filter), index_(index), name_(name),
+        type_(type) {}
+
+  ~Client() {
+    for (auto port : ports_) {
+      port_pool_->destroy(port);
+    }
+  }
+
+  const int get_index() { return index_; }
+
+  std::string_view get_name() { return name_; }
+
+  const snd_seq_client_type get_type() { return type_; }
+
+  // ports are only enumerated the first time they are asked for
+  const std::vector<Port *> *get_ports() {
+    if (!ports_loaded_) {
+      populate_ports();
+    }
+    return &ports_;
+  };
+
+  const int get_num_ports() { return get_ports()->size(); };
+
+  Port *find_port(int index) {
+    get_ports();
+    auto it = ports_by_index_.find(index);
+    return it != ports_by_index_.end() ? it->second : nullptr;
+  }
+
+  Port *find_port(std::string_view name) {
+    get_ports();
+    auto it = ports_by_name_.find(name);
+    return it != ports_by_name_.end() ? it->second : nullptr;
+  }
+
+  // the ports enumerated so far, without querying the sequencer
+  const std::vector<Port *> *get_loaded_ports() { return &ports_; }
+
+  bool has_ports_loaded() { return ports_loaded_; }
+
+  // take over ports enumerated elsewhere, by Seq::scan
+  void load_ports(const std::vector<ScannedPort> &ports) {
+    ports_loaded_ = true;
+    for (auto &scanned : ports) {
+      add_port(scanned.index, scanned.name, scanned.capability);
+    }
+  }
+
+  /*
+   * and their subscribers, once the ports of every client they may be
+   * subscribed to have been loaded as well
+   */
+  void load_subscribers(const std::vector<ScannedPort> &ports) {
+    for (auto &scanned : ports) {
+      auto port = find_loaded_port(scanned.index);
+      if (scanned.connections_scanned) {
+        port->load_connections(scanned.connections);
+      }
+      if (scanned.inbound_scanned) {
+        port->load_inbound(scanned.inbound);
+      }
+    }
+  }
+
+  Port *find_loaded_port(int index) {
+    auto it = ports_by_index_.find(index);
+    return it != ports_by_index_.end() ? it->second : nullptr;
+  }
+
+  void set_name(std::string_view name) {
+    name_ = names_->intern(name);
+    for (auto port : ports_) {
+      port->set_client_name(name_);
+    }
+  }
+
+  /*
+   * bring a single port up to date after a PORT_START or PORT_CHANGE
+   * announcement, without enumerating the other ports again
+   */
+  Port *update_port(int index) {
+    if (!ports_loaded_) {
+      return find_port(index);
+    }
+
+    PortInfo info;
+    // a port that stops passing the filter is dropped as if it had gone
+    if (backend_->get_port(index_, index, info) < 0 ||
+        !filter_->accepts_port(info.capability)) {
+      remove_port(index);
+      return nullptr;
+    }
+    auto name = names_->intern(info.name);
+    unsigned int capability = info.capability;
+
+    Port *port;
+    auto it = ports_by_index_.find(index);
+    if (it != ports_by_index_.end()) {
+      port = it->second;
+      unindex_name(port);
+      port->set_name(name);
+      port->set_capability(capability);
+    } else {
+      port = port_pool_->create(backend_, names_, lookup_, index_, name_,
+                                index, name, capability);
+      // keep the ports in the order the sequencer reports them
+      auto pos = std::lower_bound(
+          ports_.begin(), ports_.end(), index,
+          [](Port *p, int index) { return p->get_index() < index; });
+      ports_.insert(pos, port);
+      ports_by_index_.emplace(index, port);
+    }
+    ports_by_name_.emplace(port->get_name(), port);
+    return port;
+  }
+
+  void remove_port(int index) {
+    auto it = ports_by_index_.find(index);
+    if (it == ports_by_index_.end()) {
+      return;
+    }
+    auto port = it->second;
+    unindex_name(port);
+    ports_by_index_.erase(it);
+    ports_.erase(std::find(ports_.begin(), ports_.end(), port));
+    port_pool_->destroy(port);
+  }
+
+private:
+  Backend *backend_;
+  NamePool *names_;
+  NameLookup *lookup_;
+  ObjectPool<Port> *port_pool_;
+  const PortFilter *filter_;
+  int index_;
+  std::string_view name_;
+  snd_seq_client_type type_;
+  std::vector<Port *> ports_;
+  bool ports_loaded_ = false;
+  std::unordered_map<int, Port *> ports_by_index_;
+  // keys view interned names
+  std::unordered_map<std::string_view, Port *> ports_by_name_;
+
+  // ports the filter drops are never added, so never queried further
+  void populate_ports() {
+    ports_loaded_ = true;
+    query_ports(*backend_, index_,
+                [&](int index, const char *name, unsigned int capability) {
+                  if (filter_->accepts_port(capability)) {
+                    add_port(index, name, capability);
+                  }
+                });
+  };
+
+  Port *add_port(int index, std::string_view name, unsigned int capability) {
+    auto port = port_pool_->create(backend_, names_, lookup_, index_, name_,
+                                   index, names_->intern(name), capability);
+    ports_.push_back(port);
+    ports_by_index_.emplace(index, port);
+    // the first port wins if a client reuses a name
+    ports_by_name_.emplace(port->get_name(), port);
+    return port;
+  }
+
+  /*
+   * drop a port from the name index, handing the name over to the next
+   * port that shares it
+   */
+  void unindex_name(Port *port) {
+    auto it = ports_by_name_.find(port->get_name());
+    if (it == ports_by_name_.end() || it->second != port) {
+      return;
+    }
+    ports_by_name_.erase(it);
+    for (auto other : ports_) {
+      if (other != port && other->get_name() == port->get_name()) {
+        ports_by_name_.emplace(other->get_name(), other);
+        break;
+      }
+    }
+  }
+};
+
+/*
+ * collects listing output in memory and hands it to stdout with a single
+ * write() at the end, or whenever more than flush_threshold has piled up
+ */
+class Writer {
+public:
+  ~Writer() { flush(); }
+
+  template <typename... Args>
+  void print(fmt::format_string<Args...> format, Args &&...args) {
+    fmt::format_to(std::back_inserter(buf_), format,
+                   std::forward<Args>(args)...);
+    maybe_flush();
+  }
+
+  void append(std::string_view text) {
+    buf_.append(text);
+    maybe_flush();
+  }
+
+  // a JSON string literal, quotes included. the escapes used are also those
+  // of TOML basic strings, so this doubles as toml_string
+  void json_string(std::string_view text) {
+    buf_ += '"';
+    for (unsigned char c : text) {
+      switch (c) {
+      case '"':
+        buf_ += "\\\"";
+        break;
+      case '\\':
+        buf_ += "\\\\";
+        break;
+      case '\n':
+        buf_ += "\\n";
+        break;
+      case '\t':
+        buf_ += "\\t";
+        break;
+      default:
+        if (c < 0x20 || c == 0x7f) {
+          fmt::format_to(std::back_inserter(buf_), "\\u{:04x}", c);
+        } else {
+          buf_ += c;
+        }
+      }
+    }
+    buf_ += '"';
+  }
+
+  void toml_string(std::string_view text) { json_string(text); }
+
+  // a TOML key, left bare where the syntax allows it
+  void toml_key(std::string_view key) {
+    bool bare = !key.empty();
+    for (unsigned char c : key) {
+      bare = bare && (isalnum(c) || c == '_' || c == '-');
+    }
+    if (bare) {
+      append(key);
+    } else {
+      toml_string(key);
+    }
+  }
+
+  void flush() {
+    size_t done = 0;
+    while (done < buf_.size()) {
+      ssize_t n = write(STDOUT_FILENO, buf_.data() + done, buf_.size() - done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      done += n;
+    }
+    buf_.clear();
+  }
+
+private:
+  static constexpr size_t flush_threshold = 1 << 20;
+  std::string buf_;
+
+  void maybe_flush() {
+    if (buf_.size() >= flush_threshold) {
+      flush();
+    }
+  }
+};
+
+/*
+ * many named profiles in one file that is mapped instead of parsed. every
+ * address string is stored once and the edges of a profile refer to them by
+ * number, sorted by sender and then destination. the layout is
+ *
+ *   Header | Profile[profiles], by name | Text[strings] | chars | Edge...
+ *
+ * in native byte order, with offsets counted from the start of the file
+ * except for Text::offset, which counts from the start of chars
+ */
+class ProfileStore {
+public:
+  struct Edge {
+    uint32_t sender;
+    uint32_t dest;
+    int32_t queue;
+    uint8_t exclusive;
+    uint8_t convert_time;
+    uint8_t convert_real;
+    uint8_t unused;
+  };
+
+  struct Profile {
+    uint32_t name;
+    uint32_t edge_count;
+    uint64_t edges;
+  };
+
+  ProfileStore() = default;
+  ProfileStore(const ProfileStore &) = delete;
+  ProfileStore &operator=(const ProfileStore &) = delete;
+
+  ~ProfileStore() {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+    }
+  }
+
+  /*
+   * map the store at path. a store that doesn't exist yet is empty
+   */
+  int open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno == ENOENT) {
+        return 0;
+      }
+      std::cerr << "can't open profile store '" << path << "' ("
+                << strerror(errno) << ")\n";
+      return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *data =
+          mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<char *>(data);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+    if (data_ == nullptr || !valid()) {
+      std::cerr << "'" << path << "' is not a profile store\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  size_t size() const { return header_ ? header_->profiles : 0; }
+
+  size_t string_count() const { return header_ ? header_->strings : 0; }
+
+  const Profile &profile(size_t index) const { return profiles_[index]; }
+
+  // empty for an id that is out of range
+  std::string_view string(uint32_t id) const {
+    if (id >= string_count() || texts_[id].offset > header_->chars_size ||
+        texts_[id].length > header_->chars_size - texts_[id].offset) {
+      return {};
+    }
+    return {chars_ + texts_[id].offset, texts_[id].length};
+  }
+
+  const Profile *find(std::string_view name) const {
+    auto end = profiles_ + size();
+    auto it = std::lower_bound(profiles_, end, name,
+                               [&](const Profile &profile, std::string_view n) {
+                                 return string(profile.name) < n;
+                               });
+    if (it == end || string(it->name) != name) {
+      return nullptr;
+    }
+    return it;
+  }
+
+  // nullptr when the profile's edges would lie outside the file
+  const Edge *edges(const Profile &profile) const {
+    if (profile.edges % alignof(Edge) != 0 || profile.edges > size_ ||
+        profile.edge_count > (size_ - profile.edges) / sizeof(Edge)) {
+      return nullptr;
+    }
+    auto edges = reinterpret_cast<const Edge *>(data_ + profile.edges);
+    for (uint32_t i = 0; i < profile.edge_count; i++) {
+      if (edges[i].sender >= string_count() ||
+          edges[i].dest >= string_count()) {
+        return nullptr;
+      }
+    }
+    return edges;
+  }
+
+  /*
+   * collects profiles in memory and writes them out as a new store
+   */
+  class Builder {
+  public:
+    // the edges added after this belong to the new profile
+    void add_profile(std::string_view name) {
+      profiles_.push_back({intern(name), {}});
+    }
+
+    void add_edge(std::string_view sender, std::string_view dest, int queue,
+                  bool exclusive, bool convert_time, bool convert_real) {
+      profiles_.back().edges.push_back({intern(sender), intern(dest),
+                                        queue, exclusive, convert_time,
+                                        convert_real, 0});
+    }
+
+    /*
+     * write to a temporary file next to path and rename it over path, so
+     * readers see either the old store or the new one
+     */
+    int write(const char *path) {
+      std::sort(profiles_.begin(), profiles_.end(),
+                [&](const Pending &a, const Pending &b) {
+                  return strings_[a.name] < strings_[b.name];
+                });
+      size_t chars_size = 0;
+      for (auto &str : strings_) {
+        chars_size += str.size();
+      }
+      chars_size = (chars_size + 7) & ~size_t(7);
+
+      Header header = {{'N', 'E', 'O', 'A', 'P', 'R', 'F', 0},
+                       version,
+                       (uint32_t)profiles_.size(),
+                       (uint32_t)strings_.size(),
+                       0,
+                       chars_size};
+      uint64_t offset = sizeof(Header) + profiles_.size() * sizeof(Profile) +
+                        strings_.size() * sizeof(Text) + chars_size;
+
+      std::string buf(reinterpret_cast<const char *>(&header), sizeof(header));
+      for (auto &pending : profiles_) {
+        auto &edges = pending.edges;
+        std::sort(edges.begin(), edges.end(),
+                  [](const Edge &a, const Edge &b) {
+                    return a.sender != b.sender ? a.sender < b.sender
+                                                : a.dest < b.dest;
+                  });
+        // a connection listed twice is only stored once
+        edges.erase(std::unique(edges.begin(), edges.end(),
+                                [](const Edge &a, const Edge &b) {
+                                  return a.sender == b.sender &&
+                                         a.dest == b.dest;
+                                }),
+                    edges.end());
+        Profile profile = {pending.name, (uint32_t)edges.size(), offset};
+        buf.append(reinterpret_cast<const char *>(&profile), sizeof(profile));
+        offset += edges.size() * sizeof(Edge);
+      }
+      uint32_t text_offset = 0;
+      for (auto &str : strings_) {
+        Text text = {text_offset, (uint32_t)str.size()};
+        buf.append(reinterpret_cast<const char *>(&text), sizeof(text));
+        text_offset += str.size();
+      }
+      for (auto &str : strings_) {
+        buf.append(str);
+      }
+      buf.resize(buf.size() + chars_size - text_offset, '\0');
+      for (auto &pending : profiles_) {
+        buf.append(reinterpret_cast<const char *>(pending.edges.data()),
+                   pending.edges.size() * sizeof(Edge));
+      }
+
+      auto tmp = fmt::format("{}.tmp", path);
+      std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+      file.write(buf.data(), buf.size());
+      file.close();
+      if (!file) {
+        std::cerr << "can't write profile store '" << tmp << "'\n";
+        unlink(tmp.c_str());
+        return 1;
+      }
+      if (rename(tmp.c_str(), path) != 0) {
+        std::cerr << "can't replace profile store '" << path << "' ("
+                  << strerror(errno) << ")\n";
+        unlink(tmp.c_str());
+        return 1;
+      }
+      return 0;
+    }
+
+    // the connections written for a profile, once write() has left out
+    // those listed twice
+    uint32_t edge_count(std::string_view name) const {
+      for (auto &pending : profiles_) {
+        if (strings_[pending.name] == name) {
+          return pending.edges.size();
+        }
+      }
+      return 0;
+    }
+
+  private:
+    struct Pending {
+      uint32_t name;
+      std::vector<Edge> edges;
+    };
+    // a deque so that the index keys stay where they are
+    std::deque<std::string> strings_;
+    std::unordered_map<std::string_view, uint32_t> ids_;
+    std::vector<Pending> profiles_;
+
+    uint32_t intern(std::string_view str) {
+      auto it = ids_.find(str);
+      if (it != ids_.end()) {
+        return it->second;
+      }
+      strings_.emplace_back(str);
+      ids_.emplace(strings_.back(), strings_.size() - 1);
+      return strings_.size() - 1;
+    }
+  };
+
+private:
+  static constexpr uint32_t version = 1;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t profiles;
+    uint32_t strings;
+    uint32_t unused;
+    uint64_t chars_size;
+  };
+
+  struct Text {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  char *data_ = nullptr;
+  size_t size_ = 0;
+  const Header *header_ = nullptr;
+  const Profile *profiles_ = nullptr;
+  const Text *texts_ = nullptr;
+  const char *chars_ = nullptr;
+
+  // check that the tables fit in the file, their contents are checked as
+  // they are used
+  bool valid() {
+    if (size_ < sizeof(Header)) {
+      return false;
+    }
+    auto header = reinterpret_cast<const Header *>(data_);
+    if (memcmp(header->magic, "NEOAPRF", 8) != 0 ||
+        header->version != version) {
+      return false;
+    }
+    uint64_t end = sizeof(Header) + (uint64_t)header->profiles * sizeof(Profile) +
+                   (uint64_t)header->strings * sizeof(Text);
+    if (end > size_ || header->chars_size > size_ - end) {
+      return false;
+    }
+    header_ = header;
+    profiles_ = reinterpret_cast<const Profile *>(data_ + sizeof(Header));
+    texts_ = reinterpret_cast<const Text *>(profiles_ + header->profiles);
+    chars_ = reinterpret_cast<const char *>(texts_ + header->strings);
+    return true;
+  }
+};
+
+class Seq : public NameLookup {
+public:
+  using Clients = std::vector<Client *>;
+  enum output_format : int {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_NDJSON,
+    FORMAT_DOT
+  };
+
+  // how the senders and receivers matched by patterns are paired up
+  enum pairing : int { PAIR_ALL, PAIR_ZIP, PAIR_ALL_TO_ONE, PAIR_ONE_TO_ALL };
+  // #define SND_SEQ_PORT_CAP_READ		(1<<0)	/**< readable from this
+  // port
+  // */ #define SND_SEQ_PORT_CAP_WRITE		(1<<1)	/**< writable to
+  // this port */
+  //
+  // #define SND_SEQ_PORT_CAP_SYNC_READ	(1<<2)	/**< allow read
+  // subscriptions
+  // */ #define SND_SEQ_PORT_CAP_SYNC_WRITE	(1<<3)	/**< allow write
+  // subscriptions */
+  //
+  // #define SND_SEQ_PORT_CAP_DUPLEX		(1<<4)	/**< allow read/write
+  // duplex
+  // */
+  //
+  // #define SND_SEQ_PORT_CAP_SUBS_READ	(1<<5)	/**< allow read
+  // subscription
+  // */ #define SND_SEQ_PORT_CAP_SUBS_WRITE	(1<<6)	/**< allow write
+  // subscription */
+  // #define SND_SEQ_PORT_CAP_NO_EXPORT	(1<<7)	/**< routing not allowed
+  // */
+
+  Seq() : Seq(std::make_unique<AlsaBackend>()) {}
+
+  explicit Seq(std::unique_ptr<Backend> backend, Trace *trace = nullptr)
+      : backend(std::move(backend)), trace(trace) {}
+
+  /*
+   * time the rest of the enclosing block as the named phase, if tracing
+   */
+  Trace::Scope phase(const char *name, int thread = 0) {
+    return {trace, name, thread};
+  }
+
+  /*
+   * restrict the clients and ports that are loaded, and so everything
+   * listed, to those the filter accepts. only has an effect before the
+   * topology is first looked at
+   */
+  void set_filter(const PortFilter &f) {
+    filter.input = f.input;
+    filter.output = f.output;
+    filter.exported = f.exported;
+    filter.client_type = f.client_type;
+    filter.trace = trace;
+  }
+
+  /*
+   * apply profiles and remove connections on this many workers, each with a
+   * sequencer handle of its own. 1 applies them in order on this handle
+   */
+  void set_threads(int threads) { apply_threads = threads; }
+
+  /*
+   * refuse to connect a port to one it is already reachable from, and to
+   * restore a profile whose connections would loop
+   */
+  void set_refuse_cycles(bool refuse) { refuse_cycles = refuse; }
+
+  /*
+   * the topology is loaded lazily: clients are enumerated on first use,
+   * ports and subscribers only when a command actually looks at them
+   */
+  void populate_clients() {
+    auto span = phase("populate_clients");
+    clients_loaded = true;
+    ClientInfo info;
+    for (int index = -1; backend->next_client(index, info) >= 0;) {
+      index = info.client;
+      if (!filter.accepts_client(info.type)) {
+        continue;
+      }
+      // reuse clients that were already looked up by number
+      auto &client = clients_by_index[index];
+      if (client == nullptr) {
+        client = client_pool.create(backend.get(), &names, this, &port_pool,
+                                    &filter, index, names.intern(info.name),
+                                    info.type);
+      }
+      clients.push_back(client);
+      // the first client wins if a name is reused
+      clients_by_name.emplace(client->get_name(), client);
+    }
+  };
+
+  std::vector<Client *> *get_clients() {
+    if (!clients_loaded) {
+      populate_clients();
+    }
+    return &clients;
+  }
+
+  /*
+   * load the ports of every client, and their subscribers as well if
+   * connections is set, on worker threads that each query a share of the
+   * clients through a sequencer handle of their own. results are merged in
+   * client order, so the topology ends up the same as after a serial scan.
+   * with a single thread this does nothing and loading stays lazy
+   */
+  void scan(int threads, bool connections) {
+    auto span = phase("scan");
+    std::vector<Client *> pending;
+    for (auto client : *get_clients()) {
+      if (!client->has_ports_loaded()) {
+        pending.push_back(client);
+      }
+    }
+    threads = std::min<int>(threads, pending.size());
+    if (threads <= 1) {
+      return;
+    }
+
+    std::vector<int> client_ids;
+    for (auto client : pending) {
+      client_ids.push_back(client->get_index());
+    }
+    std::vector<std::vector<ScannedPort>> results(pending.size());
+    // clients a worker could not get to are left to the lazy loading
+    std::vector<char> scanned(pending.size(), false);
+    std::atomic<size_t> next{0};
+
+    auto worker = [&](int thread) {
+      auto span = phase("scan_worker", thread);
+      auto handle = backend->open_another();
+      if (handle == nullptr) {
+        return;
+      }
+      for (size_t i; (i = next++) < pending.size();) {
+        auto &ports = results[i];
+        query_ports(*handle, client_ids[i],
+                    [&](int index, const char *name, unsigned int capability) {
+                      if (filter.accepts_port(capability)) {
+                        ports.push_back(
+                            {index, name, capability, {}, false, {}, false});
+                      }
+                    });
+        for (auto &port : ports) {
+          if (!connections) {
+            break;
+          }
+          // names are looked up once everything has been merged
+          auto scan_edges = [&](std::vector<SubscriberInfo> &edges,
+                                snd_seq_query_subs_type_t type) {
+            query_subscribers(
+                *handle, client_ids[i], port.index,
+                [&](const SubscriberInfo &sub) { edges.push_back(sub); },
+                type);
+          };
+          scan_edges(port.connections, SND_SEQ_QUERY_SUBS_READ);
+          port.connections_scanned = true;
+          // see index_inbound
+          if (filter.dropped()) {
+            scan_edges(port.inbound, SND_SEQ_QUERY_SUBS_WRITE);
+            port.inbound_scanned = true;
+          }
+        }
+        scanned[i] = true;
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+      workers.emplace_back(worker, i + 1);
+    }
+    for (auto &thread : workers) {
+      thread.join();
+    }
+
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (scanned[i]) {
+        pending[i]->load_ports(results[i]);
+      }
+    }
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (scanned[i]) {
+        pending[i]->load_subscribers(results[i]);
+      }
+    }
+    invalidate_port_names();
+    inbound_indexed = false;
+  }
+
+  /*
+   * look up a single client by number without enumerating all of them
+   */
+  Client *find_client(int index) {
+    auto it = clients_by_index.find(index);
+    if (it != clients_by_index.end()) {
+      return it->second;
+    }
+    if (clients_loaded) {
+      return nullptr;
+    }
+
+    ClientInfo info;
+    if (backend->get_client(index, info) < 0) {
+      return nullptr;
+    }
+    auto client = client_pool.create(backend.get(), &names, this, &port_pool,
+                                     &filter, index, names.intern(info.name),
+                                     info.type);
+    clients_by_index.emplace(index, client);
+    return client;
+  }
+
+  bool find_names(int client_id, int port_id, std::string_view &client_name,
+                  std::string_view &port_name) override {
+    auto client = find_client(client_id);
+    auto port = client ? client->find_port(port_id) : nullptr;
+    if (port == nullptr) {
+      return false;
+    }
+    client_name = client->get_name();
+    port_name = port->get_name();
+    return true;
+  }
+
+  Client *find_client(std::string_view name) {
+    get_clients();
+    auto it = clients_by_name.find(name);
+    return it != clients_by_name.end() ? it->second : nullptr;
+  }
+
+  /*
+   * look up a port by name across all clients, for the ":PORTNAME" shortcut.
+   * returns nullptr and sets ambiguous if more than one client has a port
+   * with that name
+   */
+  Port *find_unique_port(std::string_view name, bool &ambiguous) {
+    if (!ports_indexed) {
+      ports_indexed = true;
+      ports_by_name.clear();
+      for (auto client : *get_clients()) {
+        for (auto port : *client->get_ports()) {
+          auto [it, inserted] = ports_by_name.emplace(port->get_name(), port);
+          if (!inserted) {
+            it->second = nullptr;
+          }
+        }
+      }
+    }
+    auto it = ports_by_name.find(name);
+    ambiguous = it != ports_by_name.end() && it->second == nullptr;
+    return it != ports_by_name.end() ? it->second : nullptr;
+  }
+
+  /*
+   * split an address into its client and port parts without allocating.
+   * accepted forms are "client:port", "client.port", "client" and ":port".
+   * either part may be wrapped in single or double quotes, and a backslash
+   * escapes the next character, so names containing ':' or '.' can be given
+   * as 'Ch. 1':0 or Ch\. 1:0. parts are returned as views into arg unless
+   * they contained escapes, in which case they are unescaped into scratch
+   */
+  static bool split_address(std::string_view arg, std::string_view &client,
+                            std::string_view &port, char *scratch,
+                            size_t scratch_len) {
+    size_t pos = 0;
+    size_t used = 0;
+
+    auto component = [&](std::string_view &out) -> bool {
+      char quote = 0;
+      if (pos < arg.size() && (arg[pos] == '\'' || arg[pos] == '"')) {
+        quote = arg[pos++];
+      }
+      size_t begin = pos;
+      bool escaped = false;
+      for (; pos < arg.size(); pos++) {
+        char c = arg[pos];
+        if (c == '\\') {
+          escaped = true;
+          if (++pos == arg.size()) {
+            return false;
+          }
+        } else if (quote ? c == quote : c == ':' || c == '.') {
+          break;
+        }
+      }
+      if (quote) {
+        if (pos == arg.size()) {
+          // unterminated quote
+          return false;
+        }
+        out = arg.substr(begin, pos++ - begin);
+      } else {
+        out = arg.substr(begin, pos - begin);
+      }
+      if (escaped) {
+        size_t start = used;
+        for (size_t i = 0; i < out.size(); i++) {
+          if (out[i] == '\\') {
+            i++;
+          }
+          if (used == scratch_len) {
+            return false;
+          }
+          scratch[used++] = out[i];
+        }
+        out = std::string_view(scratch + start, used - start);
+      }
+      return true;
+    };
+
+    if (!component(client)) {
+      return false;
+    }
+    port = std::string_view();
+    if (pos < arg.size()) {
+      if (arg[pos] != ':' && arg[pos] != '.') {
+        return false;
+      }
+      pos++;
+      if (!component(port)) {
+        return false;
+      }
+    }
+    return pos == arg.size() && (client.size() || port.size());
+  }
+
+  /*
+   * append a name to out with a backslash before the characters that
+   * split_address would otherwise take as syntax
+   */
+  static void escape_name(std::string_view name, std::string &out) {
+    for (char c : name) {
+      if (c == ':' || c == '.' || c == '\\' || c == '\'' || c == '"') {
+        out += '\\';
+      }
+      out += c;
+    }
+  }
+
+  /*
+   * resolve client:port, client.port, client or :port to an address.
+   * returns -EINVAL if arg is not an address and -ENOENT if nothing matches
+   */
+  int parse_address(snd_seq_addr_t *addr, std::string_view arg) {
+    std::string_view arg_client_name, arg_port_name;
+    // ALSA names are limited to 64 characters
+    char scratch[128];
+    Client *client = nullptr;
+    Port *port;
+    int arg_client_id = -1;
+    int arg_port_id = -1;
+
+    // an empty address, e.g. from a damaged store, is refused here too
+    if (!split_address(arg, arg_client_name, arg_port_name, scratch,
+                       sizeof(scratch))) {
+      return -EINVAL;
+    }
+
+    if (arg_client_name.length() != 0)
+    // client name or number was provided
+    {
+      if (parse_number(arg_client_name, arg_client_id)) {
+        client = find_client(arg_client_id);
+      } else {
+        // number not found, interpret as string
+        client = find_client(arg_client_name);
+      }
+
+      if (client == NULL) {
+        // client not found
+        return -ENOENT;
+      }
+
+      if (arg_port_name.size() == 0) {
+        // port not provided
+        if (client->get_num_ports() == 0) {
+          return -ENOENT;
+        }
+        port = client->get_ports()->front();
+        addr->client = client->get_index();
+        addr->port = port->get_index();
+        return 0;
+      }
+
+      if (parse_number(arg_port_name, arg_port_id)) {
+        port = client->find_port(arg_port_id);
+      } else {
+        // number not found, interpret as string
+        port = client->find_port(arg_port_name);
+      }
+      if (port != nullptr) {
+        addr->client = client->get_index();
+        addr->port = port->get_index();
+        return 0;
+      }
+    } else
+    // client name was not provided, search for port name in all clients
+    {
+      bool ambiguous;
+      port = find_unique_port(arg_port_name, ambiguous);
+      if (ambiguous) {
+        std::cerr << "port name '" << arg_port_name
+                  << "' is not unique, use client:port instead\n";
+        return -ENOENT;
+      }
+      if (port != nullptr) {
+        addr->client = port->get_client_id();
+        addr->port = port->get_index();
+        return 0;
+      }
+    }
+
+    return -ENOENT;
+  }
+
+  /*
+   * patch the loaded topology from a System:Announce event instead of
+   * enumerating everything again. every event bumps the generation
+   */
+  void update_topology(const snd_seq_event_t *ev) {
+    const snd_seq_addr_t &addr = ev->data.addr;
+    const snd_seq_connect_t &connect = ev->data.connect;
+    Client *client;
+    Port *port;
+
+    switch (ev->type) {
+    case SND_SEQ_EVENT_CLIENT_START:
+    case SND_SEQ_EVENT_CLIENT_CHANGE:
+      update_client(addr.client);
+      break;
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+      remove_client(addr.client);
+      for_each_loaded_port([&](Port *p) { p->remove_connections(addr.client, -1); });
+      break;
+    case SND_SEQ_EVENT_PORT_START:
+    case SND_SEQ_EVENT_PORT_CHANGE:
+      client = find_client(addr.client);
+      if (client == nullptr) {
+        client = update_client(addr.client);
+      }
+      port = client ? client->update_port(addr.port) : nullptr;
+      if (port != nullptr) {
+        for_each_loaded_port([&](Port *p) {
+          p->rename_connection(addr.client, addr.port, port->get_name());
+        });
+      }
+      invalidate_port_names();
+      break;
+    case SND_SEQ_EVENT_PORT_EXIT:
+      if (clients_by_index.count(addr.client)) {
+        clients_by_index[addr.client]->remove_port(addr.port);
+      }
+      for_each_loaded_port([&](Port *p) { p->remove_connections(addr.client, addr.port); });
+      invalidate_port_names();
+      break;
+    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+      port = find_loaded_port(connect.sender);
+      if (port != nullptr && port->has_connections_loaded()) {
+        Connection conn;
+        if (make_connection(connect.dest, conn) == 0) {
+          port->add_connection(conn);
+        }
+      }
+      break;
+    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+      port = find_loaded_port(connect.sender);
+      if (port != nullptr) {
+        port->remove_connections(connect.dest.client, connect.dest.port);
+      }
+      break;
+    default:
+      return;
+    }
+    generation++;
+    inbound_indexed = false;
+  }
+
+  /*
+   * number of announcements applied to the loaded topology
+   */
+  uint64_t get_generation() { return generation; }
+
+  /*
+   * compare the loaded topology against a fresh enumeration on a separate
+   * handle and print every difference. returns the number of differences
+   */
+  int check_topology() {
+    auto handle = backend->open_another();
+    if (handle == nullptr) {
+      std::cerr << "can't open a second sequencer handle\n";
+      return 1;
+    }
+    Seq fresh(std::move(handle));
+    int self = backend->client_id();
+    int other = fresh.backend->client_id();
+    checker_clients[other]++;
+    int differences = 0;
+
+    auto report = [&](const std::string &what) {
+      std::cerr << "topology mismatch at generation " << generation << ": "
+                << what << "\n";
+      differences++;
+    };
+
+    auto describe = [](Client *client) {
+      return fmt::format("client {} '{}'", client->get_index(),
+                         client->get_name());
+    };
+
+    auto compare_ports = [&](Client *mine, Client *theirs) {
+      for (auto port : *theirs->get_ports()) {
+        auto ours = mine->find_port(port->get_index());
+        if (ours == nullptr) {
+          report(fmt::format("{} port {} '{}' missing", describe(theirs),
+                             port->get_index(), port->get_name()));
+          continue;
+        }
+        if (ours->get_name() != port->get_name() ||
+            ours->get_capability() != port->get_capability()) {
+          report(fmt::format("{} port {} is '{}' ({:#x}), expected '{}' ({:#x})",
+                             describe(theirs), port->get_index(),
+                             ours->get_name(), ours->get_capability(),
+                             port->get_name(), port->get_capability()));
+        }
+
+        auto key = [&](const Connection &conn) {
+          return fmt::format("{}:{} ({}:{})", conn.client_id_, conn.port_id_,
+                             conn.client_name_, conn.port_name_);
+        };
+        std::vector<std::string> expected, actual;
+        for (auto &conn : port->get_connections()) {
+          if (conn.client_id_ != self && conn.client_id_ != other) {
+            expected.push_back(key(conn));
+          }
+        }
+        for (auto &conn : ours->get_connections()) {
+          if (conn.client_id_ != self && conn.client_id_ != other) {
+            actual.push_back(key(conn));
+          }
+        }
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+        if (expected != actual) {
+          report(fmt::format("{} port {} connections differ",
+                             describe(theirs), port->get_index()));
+        }
+      }
+      for (auto port : *mine->get_ports()) {
+        if (theirs->find_port(port->get_index()) == nullptr) {
+          report(fmt::format("{} port {} '{}' is stale", describe(mine),
+                             port->get_index(), port->get_name()));
+        }
+      }
+    };
+
+    for (auto client : *fresh.get_clients()) {
+      if (client->get_index() == self || client->get_index() == other) {
+        continue;
+      }
+      auto mine = find_client(client->get_index());
+      if (mine == nullptr) {
+        report(describe(client) + " missing");
+      } else if (mine->get_name() != client->get_name()) {
+        report(fmt::format("{}, expected '{}'", describe(mine),
+                           client->get_name()));
+      } else {
+        compare_ports(mine, client);
+      }
+    }
+    for (auto client : *get_clients()) {
+      if (client->get_index() != self && client->get_index() != other &&
+          fresh.find_client(client->get_index()) == nullptr) {
+        report(describe(client) + " is stale");
+      }
+    }
+
+    return differences;
+  }
+
+  /*
+   * stay resident and subscribe the routes of a TOML profile as soon as
+   * the ports they connect appear, instead of re-applying the whole file
+   */
+  int run_daemon(char *filename, int timeout_ms = 1000, bool verify = false) {
+    std::vector<Route> routes;
+    if (read_profile(filename, routes) != 0) {
+      return 1;
+    }
+
+    if (open_announce_port() < 0) {
+      return 1;
+    }
+
+    // index the routes by the client and port names they mention, so an
+    // appearing port only has to look at the routes that can involve it
+    std::unordered_multimap<std::string, size_t> routes_by_client;
+    std::unordered_multimap<std::string, size_t> routes_by_port;
+    for (size_t i = 0; i < routes.size(); i++) {
+      for (auto address : {&routes[i].sender, &routes[i].dest}) {
+        std::string_view client_name, port_name;
+        char scratch[128];
+        if (!split_address(*address, client_name, port_name, scratch,
+                           sizeof(scratch))) {
+          std::cerr << "invalid address '" << *address << "'\n";
+        } else if (client_name.empty()) {
+          routes_by_port.emplace(port_name, i);
+        } else {
+          routes_by_client.emplace(client_name, i);
+        }
+      }
+    }
+
+    // connect everything that is already there
+    {
+      auto span = phase("resolve");
+      for (auto &route : routes) {
+        resolve_route(route, true);
+      }
+    }
+    subscribe_routes(routes, timeout_ms);
+    for (auto &route : routes) {
+      if (route.state == confirmed) {
+        std::cout << "connected " << route.sender << " -> " << route.dest
+                  << "\n";
+      }
+    }
+    std::cout << std::flush;
+
+    std::vector<size_t> candidates;
+    auto add_candidates = [&](auto &index, std::string_view key) {
+      auto range = index.equal_range(std::string(key));
+      for (auto it = range.first; it != range.second; ++it) {
+        candidates.push_back(it->second);
+      }
+    };
+
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+    int self = backend->client_id();
+
+    // connect the routes involving a port that appeared or was renamed.
+    // a port of -1 stands for every port of a renamed client
+    auto connect_routes = [&](int client_id, int port_id) {
+      auto client = find_client(client_id);
+      if (client == nullptr) {
+        return;
+      }
+
+      candidates.clear();
+      add_candidates(routes_by_client, client->get_name());
+      add_candidates(routes_by_client, std::to_string(client_id));
+      for (auto port : *client->get_ports()) {
+        if (port_id < 0 || port->get_index() == port_id) {
+          add_candidates(routes_by_port, port->get_name());
+        }
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                       candidates.end());
+
+      auto involved = [&](const snd_seq_addr_t &addr) {
+        return addr.client == client_id &&
+               (port_id < 0 || addr.port == port_id);
+      };
+      for (auto i : candidates) {
+        auto &route = routes[i];
+        if (resolve_route(route, true) != 0 ||
+            !(involved(route.sender_addr) || involved(route.dest_addr))) {
+          continue;
+        }
+        set_subscription(subs, route);
+        int err = subscribe_port(subs);
+        if (err == 0) {
+          std::cout << "connected " << route.sender << " -> " << route.dest
+                    << std::endl;
+        } else if (err != -EEXIST) {
+          std::cerr << "connection " << route.sender << " -> " << route.dest
+                    << " failed (" << snd_strerror(err) << ")\n";
+        }
+      }
+    };
+
+    wait_announcements(-1, [&](const snd_seq_event_t *ev) {
+      if (ev->source.client != SND_SEQ_CLIENT_SYSTEM) {
+        return true;
+      }
+      auto checker = checker_clients.find(ev->data.addr.client);
+      if (checker != checker_clients.end() &&
+          ev->type >= SND_SEQ_EVENT_CLIENT_START &&
+          ev->type <= SND_SEQ_EVENT_PORT_EXIT) {
+        // the checker's own handle coming and going is not worth a check
+        if (ev->type == SND_SEQ_EVENT_CLIENT_EXIT && --checker->second == 0) {
+          checker_clients.erase(checker);
+        }
+        return true;
+      }
+      update_topology(ev);
+      // only compare once every queued announcement has been applied
+      if (verify && !backend->event_pending() &&
+          check_topology() == 0) {
+        std::cerr << "topology consistent at generation " << generation
+                  << "\n";
+      }
+      if (ev->data.addr.client == self) {
+        return true;
+      }
+      switch (ev->type) {
+      case SND_SEQ_EVENT_PORT_START:
+      case SND_SEQ_EVENT_PORT_CHANGE:
+        connect_routes(ev->data.addr.client, ev->data.addr.port);
+        break;
+      case SND_SEQ_EVENT_CLIENT_CHANGE:
+        connect_routes(ev->data.addr.client, -1);
+        break;
+      }
+      return true;
+    });
+
+    return 0;
+  }
+
+  /*
+   * print a line of NDJSON for every client, port and subscription change
+   * until killed, stamped with the monotonic clock in microseconds when the
+   * announcement was read. waits in poll() in between, and writes out as
+   * soon as the announcements that were queued together are handled
+   */
+  int watch() {
+    if (open_announce_port() < 0) {
+      return 1;
+    }
+    // exits are reported with the names from before, so every port has to
+    // be known up front. subscribers are not needed
+    {
+      auto span = phase("populate_ports");
+      for (auto client : *get_clients()) {
+        client->get_ports();
+      }
+    }
+    int self = backend->client_id();
+    watch_stamp("ready");
+    out.append("}\n");
+    out.flush();
+
+    wait_announcements(-1, [&](const snd_seq_event_t *ev) {
+      if (ev->source.client == SND_SEQ_CLIENT_SYSTEM) {
+        watch_event(ev, self);
+      }
+      if (!backend->event_pending()) {
+        out.flush();
+      }
+      return true;
+    });
+    out.flush();
+    return 0;
+  }
+
+  // probes are numbered in the two seven bit bytes of their SysEx, and a
+  // number used twice would let a late probe pass for the current one
+  static constexpr int max_probes = 1 << 14;
+
+  /*
+   * time iterations probe events, one at a time, on their way out of a port
+   * of our own and back into another. with sender and receiver the probes
+   * are sent to receiver and expected back from sender, so they pass through
+   * whatever joins the two: a thru port, a cable from a MIDI out to an in, a
+   * program echoing its input. without them the two ports are connected to
+   * each other and only the sequencer itself is timed. both ends are stamped
+   * with the real time of a queue of ours, the arrival by the kernel
+   */
+  int probe(const char *sender, const char *receiver, int iterations,
+            int timeout_ms, const char *csv_file) {
+    if (iterations > max_probes) {
+      std::cerr << "can't send more than " << max_probes << " probes\n";
+      return 1;
+    }
+    if (set_client_name() != 0) {
+      return 1;
+    }
+    int queue = backend->open_queue();
+    if (queue < 0) {
+      std::cerr << "can't allocate a queue (" << snd_strerror(queue) << ")\n";
+      return 1;
+    }
+    int out_port = backend->create_port(
+        "neoaconnect probe out",
+        SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_NO_EXPORT, -1);
+    int in_port = backend->create_port(
+        "neoaconnect probe in",
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT, queue);
+    if (out_port < 0 || in_port < 0) {
+      std::cerr << "can't create port ("
+                << snd_strerror(std::min(out_port, in_port)) << ")\n";
+      return 1;
+    }
+
+    int self = backend->client_id();
+    snd_seq_addr_t probe_out = {(unsigned char)self, (unsigned char)out_port};
+    snd_seq_addr_t probe_in = {(unsigned char)self, (unsigned char)in_port};
+    snd_seq_addr_t from = probe_out, to = probe_in;
+    if (sender != nullptr) {
+      auto span = phase("resolve");
+      if (parse_address(&from, sender) < 0) {
+        std::cerr << "invalid sender address '" << sender << "'\n";
+        return 1;
+      }
+      if (parse_address(&to, receiver) < 0) {
+        std::cerr << "invalid destination address '" << receiver << "'\n";
+        return 1;
+      }
+    }
+
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+    // the connections go away with our ports when the program exits
+    auto connect = [&](const snd_seq_addr_t &sender,
+                       const snd_seq_addr_t &dest) {
+      snd_seq_port_subscribe_set_sender(subs, &sender);
+      snd_seq_port_subscribe_set_dest(subs, &dest);
+      int err = backend->subscribe(subs);
+      if (err < 0) {
+        std::cerr << "connection failed (" << snd_strerror(err) << ")\n";
+      }
+      return err >= 0;
+    };
+    if (sender != nullptr ? !connect(probe_out, to) || !connect(from, probe_in)
+                          : !connect(probe_out, probe_in)) {
+      return 1;
+    }
+
+    // a non-commercial system exclusive message, so that a synthesizer
+    // somewhere along the way ignores it. it carries the probe number, and
+    // late arrivals of an earlier probe are not taken for the current one
+    unsigned char data[] = {0xf0, 0x7d, 0, 0, 0xf7};
+    auto is_probe = [&](const snd_seq_event_t *ev) {
+      return ev->type == SND_SEQ_EVENT_SYSEX && ev->dest.port == in_port &&
+             ev->data.ext.len == sizeof(data) &&
+             memcmp(ev->data.ext.ptr, data, sizeof(data)) == 0;
+    };
+    auto nanos = [](const snd_seq_real_time_t &time) {
+      return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+    };
+
+    // in nanoseconds, -1 for probes that never came back
+    std::vector<int64_t> latencies;
+    latencies.reserve(iterations);
+    {
+      auto span = phase("probe");
+      snd_seq_event_t ev;
+      for (int i = 0; i < iterations; i++) {
+        data[2] = (i >> 7) & 0x7f;
+        data[3] = i & 0x7f;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_source(&ev, out_port);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+        snd_seq_ev_set_sysex(&ev, sizeof(data), data);
+
+        snd_seq_real_time_t sent, arrived;
+        int err = backend->queue_time(queue, sent);
+        if (err >= 0) {
+          err = backend->send_event(&ev);
+        }
+        if (err < 0) {
+          std::cerr << "can't send probe (" << snd_strerror(err) << ")\n";
+          return 1;
+        }
+        bool back =
+            wait_announcements(timeout_ms, [&](const snd_seq_event_t *in) {
+              if (!is_probe(in)) {
+                return true;
+              }
+              arrived = in->time.time;
+              return false;
+            });
+        latencies.push_back(back ? nanos(arrived) - nanos(sent) : -1);
+      }
+    }
+
+    if (csv_file != nullptr && write_probe_csv(csv_file, latencies) != 0) {
+      return 1;
+    }
+    return print_probe_stats(latencies);
+  }
+
+  /*
+   * subscribe a private port to every sender in addresses and, every
+   * interval_ms until killed, print how many events per second each sent,
+   * by kind, along with the SysEx bytes per second and the peak rate over
+   * any burst window. everything the events are counted in is set up
+   * beforehand, so reading them allocates nothing
+   */
+  int monitor(char **addresses, int count, int interval_ms,
+              output_format format) {
+    if (set_client_name() != 0) {
+      return 1;
+    }
+    int queue = backend->open_queue();
+    if (queue < 0) {
+      std::cerr << "can't allocate a queue (" << snd_strerror(queue) << ")\n";
+      return 1;
+    }
+    // arrivals are stamped with the queue, so bursts are timed by the
+    // kernel however late they are read. it is not subscribed to
+    // announcements, so the input holds only the events being counted
+    int port = backend->create_port(
+        "neoaconnect monitor",
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT, queue);
+    if (port < 0) {
+      std::cerr << "can't create port (" << snd_strerror(port) << ")\n";
+      return 1;
+    }
+    // the most the kernel allows, to ride out a slow terminal
+    backend->set_input_size(2000);
+
+    std::vector<Traffic> senders;
+    senders.reserve(count);
+    // index into senders by client << 8 | port, -1 for everything else
+    std::vector<int> slots(1 << 16, -1);
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+    snd_seq_addr_t self = {(unsigned char)backend->client_id(),
+                           (unsigned char)port};
+    for (int i = 0; i < count; i++) {
+      snd_seq_addr_t addr;
+      if (parse_address(&addr, addresses[i]) < 0) {
+        std::cerr << "invalid sender address '" << addresses[i] << "'\n";
+        return 1;
+      }
+      auto &slot = slots[addr.client << 8 | addr.port];
+      if (slot >= 0) {
+        continue;
+      }
+      snd_seq_port_subscribe_set_sender(subs, &addr);
+      snd_seq_port_subscribe_set_dest(subs, &self);
+      int err = backend->subscribe(subs);
+      if (err < 0) {
+        std::cerr << "connection failed (" << snd_strerror(err) << ")\n";
+        return 1;
+      }
+      std::string_view client_name, port_name;
+      find_names(addr.client, addr.port, client_name, port_name);
+      slot = senders.size();
+      senders.push_back({addr, fmt::format("{}:{}", client_name, port_name)});
+    }
+
+    bool redraw = format == FORMAT_TEXT && isatty(STDOUT_FILENO);
+    if (format == FORMAT_NDJSON) {
+      watch_stamp("ready");
+      out.append("}\n");
+      out.flush();
+    }
+    auto interval = std::chrono::milliseconds(interval_ms);
+    auto last = std::chrono::steady_clock::now();
+    auto next = last + interval;
+    int overruns = 0;
+    for (bool first = true;;) {
+      // a flood is read in batches, so the table still comes out on time
+      snd_seq_event_t *ev;
+      int err = 0;
+      for (int n = 0; n < 1024; n++) {
+        err = backend->event_input(&ev);
+        if (err == -ENOSPC) {
+          overruns++;
+        } else if (err < 0) {
+          break;
+        } else if (ev->dest.port == port) {
+          int slot = slots[ev->source.client << 8 | ev->source.port];
+          if (slot >= 0) {
+            senders[slot].count(ev);
+          }
+        }
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next) {
+        auto elapsed = std::chrono::duration<double>(now - last).count();
+        print_traffic(senders, elapsed, overruns, format, first, redraw);
+        first = false;
+        overruns = 0;
+        last = now;
+        next = std::max(next + interval, now);
+      }
+      if (err < 0 && err != -ENOSPC) {
+        backend->wait_input(std::max<int64_t>(
+            1, std::chrono::duration_cast<std::chrono::milliseconds>(next - now)
+                   .count()));
+      }
+    }
+  }
+
+  /*
+   * invert the subscriptions of every port into per-port lists of senders,
+   * so both directions can be listed in O(ports + connections). once a
+   * filter has dropped something, some senders may be missing, so then
+   * every port is asked for its senders instead
+   */
+  void index_inbound() {
+    if (inbound_indexed) {
+      return;
+    }
+    auto span = phase("index_inbound");
+    inbound_indexed = true;
+    // only known once every port has been looked at
+    for (auto client : *get_clients()) {
+      client->get_ports();
+    }
+    if (filter.dropped()) {
+      for (auto client : *get_clients()) {
+        for (auto port : *client->get_ports()) {
+          if (!port->has_inbound_loaded()) {
+            port->query_inbound();
+          }
+        }
+      }
+      return;
+    }
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        port->clear_inbound();
+      }
+    }
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        for (auto &conn : port->get_connections()) {
+          auto dest = find_client(conn.client_id_);
+          auto dest_port = dest ? dest->find_port(conn.port_id_) : nullptr;
+          if (dest_port != nullptr) {
+            dest_port->add_inbound(port, conn);
+          }
+        }
+      }
+    }
+  }
+
+  Clients::iterator begin() { return get_clients()->begin(); };
+
+  Clients::iterator end() { return get_clients()->end(); };
+
+  /*
+   * json prints a single document with every client and its ports, ndjson
+   * one line per port. without list_subs, only the clients and ports are
+   * listed and no subscribers are queried
+   */
+  void print_list(bool list_subs, output_format format = FORMAT_TEXT) {
+    auto span = phase("print_list");
+    if (list_subs) {
+      index_inbound();
+    }
+    bool first_client = true;
+    if (format == FORMAT_JSON) {
+      out.append("{\"clients\":[");
+    }
+    // TODO: reintroduce card info
+    for (auto client : *get_clients()) {
+      // don't print empty clients
+      if (client->get_num_ports() == 0) {
+        continue;
+      }
+      const char *type =
+          client->get_type() == SND_SEQ_USER_CLIENT ? "user" : "kernel";
+
+      if (format == FORMAT_TEXT) {
+        out.print("client {}: '{}' [type={}]\n", client->get_index(),
+                  client->get_name(), type);
+        for (auto port : *client->get_ports()) {
+          print_port(port);
+          if (!list_subs) {
+            continue;
+          }
+          for (auto &conn : port->get_connections()) {
+            out.print("    -> {}:{} ({}:{})\n", conn.client_id_,
+                      conn.port_id_, conn.client_name_, conn.port_name_);
+          }
+          for (auto &sender : port->get_inbound()) {
+            out.print("    <- {}:{} ({}:{})\n", sender.client_id_,
+                      sender.port_id_, sender.client_name_, sender.port_name_);
+          }
+        }
+        continue;
+      }
+
+      if (format == FORMAT_JSON) {
+        out.append(first_client ? "{\"client\":" : ",{\"client\":");
+        out.print("{},\"name\":", client->get_index());
+        out.json_string(client->get_name());
+        out.print(",\"type\":\"{}\",\"ports\":[", type);
+      }
+      first_client = false;
+      bool first_port = true;
+      for (auto port : *client->get_ports()) {
+        if (format == FORMAT_NDJSON) {
+          out.print("{{\"client\":{},\"client_name\":", client->get_index());
+          out.json_string(client->get_name());
+          out.print(",\"client_type\":\"{}\",", type);
+        } else {
+          out.append(first_port ? "{" : ",{");
+        }
+        first_port = false;
+        out.print("\"port\":{},\"name\":", port->get_index());
+        out.json_string(port->get_name());
+        out.print(",\"capability\":{}", port->get_capability());
+        if (list_subs) {
+          out.append(",\"connections\":[");
+          bool first = true;
+          for (auto &conn : port->get_connections()) {
+            json_endpoint(first, conn.client_id_, conn.port_id_,
+                          conn.client_name_, conn.port_name_);
+          }
+          out.append("],\"inbound\":[");
+          first = true;
+          for (auto &sender : port->get_inbound()) {
+            json_endpoint(first, sender.client_id_, sender.port_id_,
+                          sender.client_name_, sender.port_name_);
+          }
+          out.append("]");
+        }
+        out.append(format == FORMAT_NDJSON ? "}\n" : "}");
+      }
+      if (format == FORMAT_JSON) {
+        out.append("]}");
+      }
+    }
+    if (format == FORMAT_JSON) {
+      out.append("]}\n");
+    }
+    out.flush();
+  }
+
+  void print_all_ports(output_format format = FORMAT_TEXT) {
+    auto span = phase("print_all_ports");
+    bool first = true;
+    if (format == FORMAT_JSON) {
+      out.append("[");
+    }
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        if (format == FORMAT_TEXT) {
+          out.print("{}:{}\n", client->get_name(), port->get_name());
+          continue;
+        }
+        json_endpoint(first, client->get_index(), port->get_index(),
+                      client->get_name(), port->get_name());
+        if (format == FORMAT_NDJSON) {
+          out.append("\n");
+          first = true;
+        }
+      }
+    }
+    if (format == FORMAT_JSON) {
+      out.append("]\n");
+    }
+    out.flush();
+  }
+
+  /*
+   * print the addresses that complete prefix, one per line, for shell
+   * completion. every port is offered as client:port, and also as :port
+   * where its name is unique. matching ignores case, and if no address
+   * starts with prefix, the ones containing its characters in order are
+   * offered instead. subscribers are never queried
+   */
+  void complete(std::string_view prefix) {
+    auto span = phase("complete");
+    // every Tab press is a new process, so instead of building an index to
+    // use once, matches are picked out in one pass in sequencer order. the
+    // shells sort them for display anyway
+    bool found = false;
+    std::vector<std::string> contains;
+    std::string text;
+    bool ambiguous;
+    // a :port address is only offered if port is the only one of its name
+    auto consider = [&](std::string_view address, Port *port) {
+      bool starts =
+          address.size() >= prefix.size() &&
+          std::equal(prefix.begin(), prefix.end(), address.begin(),
+                     [](char a, char b) {
+                       return tolower((unsigned char)a) ==
+                              tolower((unsigned char)b);
+                     });
+      if ((!starts && (found || !is_subsequence(prefix, address))) ||
+          (port != nullptr &&
+           find_unique_port(port->get_name(), ambiguous) != port)) {
+        return;
+      }
+      if (starts) {
+        out.print("{}\n", address);
+        found = true;
+      } else {
+        contains.emplace_back(address);
+      }
+    };
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        text.clear();
+        escape_name(client->get_name(), text);
+        size_t client_length = text.size();
+        text += ':';
+        escape_name(port->get_name(), text);
+        consider(text, nullptr);
+        consider(std::string_view(text).substr(client_length), port);
+      }
+    }
+
+    if (!found) {
+      for (auto &address : contains) {
+        out.print("{}\n", address);
+      }
+    }
+    out.flush();
+  }
+
+  int subscribe(const char *send_address, const char *dest_address,
+                int queue = 0, int exclusive = 0, int convert_time = 0,
+                int convert_real = 0) {
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+
+    if (init_subscription(subs, send_address, dest_address, queue, exclusive,
+                          convert_time, convert_real) != 0) {
+      return 1;
+    }
+
+    if (refuse_cycles) {
+      auto span = phase("analyze");
+      auto &sender = *snd_seq_port_subscribe_get_sender(subs);
+      // the new connection closes a loop if the sender is reachable from
+      // the destination
+      auto chain = find_chain(*snd_seq_port_subscribe_get_dest(subs), sender);
+      if (!chain.empty()) {
+        std::cerr << "connection would loop: " << port_label(sender);
+        for (auto &addr : chain) {
+          std::cerr << " -> " << port_label(addr);
+        }
+        std::cerr << "\n";
+        return 1;
+      }
+    }
+
+    int err;
+    {
+      auto span = phase("subscribe");
+      err = subscribe_port(subs);
+    }
+    if (err == -EEXIST) {
+      std::cerr << "connection is already subscribed\n";
+      return 1;
+    }
+
+    if (err < 0) {
+      std::cerr << "connection failed (" << snd_strerror(err) << ")\n";
+      return 1;
+    }
+
+    return 0;
+  };
+
+  /*
+   * returns -EEXIST if the subscription is already in place
+   */
+  int subscribe_port(snd_seq_port_subscribe_t *subs) {
+    if (backend->get_subscription(subs) == 0) {
+      return -EEXIST;
+    }
+    return backend->subscribe(subs);
+  }
+
+  int unsubscribe(char *send_address, char *dest_address, int queue = 0,
+                  int exclusive = 0, int convert_time = 0,
+                  int convert_real = 0) {
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+
+    if (init_subscription(subs, send_address, dest_address, queue, exclusive,
+                          convert_time, convert_real) != 0) {
+      return 1;
+    }
+
+    auto span = phase("unsubscribe");
+    if (backend->get_subscription(subs) < 0) {
+      std::cerr << "no subscription is found\n";
+      return 1;
+    }
+
+    int err = backend->unsubscribe(subs);
+    if (err < 0) {
+      std::cerr << "disconnection failed (" << snd_strerror(err) << ")\n";
+      return 1;
+    }
+
+    return 0;
+  };
+
+  /*
+   * remove all (exported) connections
+   */
+  void remove_connection(Port *p) {
+    snd_seq_addr_t sender = {(unsigned char)p->get_client_id(),
+                             (unsigned char)p->get_index()};
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+
+    SubscriberInfo sub;
+    // unsubscribing shifts the next subscriber into the current index
+    for (int index = 0; backend->get_subscriber(
+                            sender, SND_SEQ_QUERY_SUBS_READ, index, sub) >= 0;) {
+      unsigned int capability;
+      if (!find_capability(sub.addr, capability) ||
+          !(capability & SND_SEQ_PORT_CAP_SUBS_WRITE) ||
+          (capability & SND_SEQ_PORT_CAP_NO_EXPORT)) {
+        index++;
+        continue;
+      }
+      snd_seq_port_subscribe_set_queue(subs, sub.queue);
+      snd_seq_port_subscribe_set_sender(subs, &sender);
+      snd_seq_port_subscribe_set_dest(subs, &sub.addr);
+      if (backend->unsubscribe(subs) < 0) {
+        index++;
+      }
+    }
+  }
+
+  // from the topology, or the sequencer for ports that aren't in it
+  bool find_capability(const snd_seq_addr_t &addr, unsigned int &capability) {
+    auto client = find_client(addr.client);
+    auto port = client ? client->find_port(addr.port) : nullptr;
+    if (port != nullptr) {
+      capability = port->get_capability();
+      return true;
+    }
+    PortInfo info;
+    if (backend->get_port(addr.client, addr.port, info) < 0) {
+      return false;
+    }
+    capability = info.capability;
+    return true;
+  }
+
+  void remove_all_connections() {
+    auto span = phase("unsubscribe");
+    if (apply_threads > 1) {
+      // the same connections as remove_connection, taken from the topology
+      std::vector<Route> routes;
+      for (auto client : *get_clients()) {
+        for (auto port : *client->get_ports()) {
+          snd_seq_addr_t sender = {(unsigned char)port->get_client_id(),
+                                   (unsigned char)port->get_index()};
+          for (auto &conn : port->get_connections()) {
+            snd_seq_addr_t dest = {(unsigned char)conn.client_id_,
+                                   (unsigned char)conn.port_id_};
+            unsigned int capability;
+            if (find_capability(dest, capability) &&
+                (capability & SND_SEQ_PORT_CAP_SUBS_WRITE) &&
+                !(capability & SND_SEQ_PORT_CAP_NO_EXPORT)) {
+              routes.push_back({{}, {}, sender, dest, pending});
+            }
+          }
+        }
+      }
+      std::vector<size_t> indices(routes.size());
+      std::iota(indices.begin(), indices.end(), 0);
+      apply_parallel(routes, indices, true, [](const snd_seq_event_t *) {});
+      return;
+    }
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        remove_connection(port);
+      }
+    }
+  }
+
+  /*
+   * json mirrors the layout of the TOML profile, ndjson prints one
+   * {"sender", "dest"} object per connection. connections with a queue or
+   * exclusive flag are written as {dest, exclusive, queue, time} tables
+   * instead of plain "client:port" strings
+   */
+  void serialize_connections(output_format format = FORMAT_TEXT) {
+    auto span = phase("serialize");
+    // sorted by name like export_profile, so the same connections always
+    // give the same file
+    auto sorted = by_name(*get_clients());
+    if (format == FORMAT_NDJSON) {
+      for (auto client : sorted) {
+        for (auto port : by_name(*client->get_ports())) {
+          for (auto &conn : port->get_connections()) {
+            if (is_exported(conn)) {
+              out.append("{\"sender\":");
+              out.json_string(fmt::format("{}:{}", client->get_name(),
+                                          port->get_name()));
+              out.append(",\"dest\":");
+              out.json_string(
+                  fmt::format("{}:{}", conn.client_name_, conn.port_name_));
+              write_attributes(conn.queue_, conn.exclusive_,
+                               conn.time_update_, conn.time_real_, format);
+              out.append("}\n");
+            }
+          }
+        }
+      }
+      out.flush();
+      return;
+    }
+
+    bool json = format == FORMAT_JSON;
+    // keys have to be unique, so only the first client or port of a name
+    // is written
+    std::unordered_set<std::string_view> clients_written;
+    std::unordered_set<std::string_view> ports_written;
+    if (json) {
+      out.append("{");
+    }
+    for (auto client : sorted) {
+      if (clients_written.count(client->get_name())) {
+        continue;
+      }
+      ports_written.clear();
+      for (auto port : by_name(*client->get_ports())) {
+        bool first = true;
+        for (auto &conn : port->get_connections()) {
+          if (!is_exported(conn)) {
+            continue;
+          }
+          if (first) {
+            if (!ports_written.insert(port->get_name()).second) {
+              break;
+            }
+            if (ports_written.size() == 1) {
+              // the client's first port with connections opens its table
+              if (json) {
+                out.append(clients_written.empty() ? "\n" : "},\n");
+                out.json_string(client->get_name());
+                out.append(":{");
+              } else {
+                out.append(clients_written.empty() ? "[" : "\n[");
+                out.toml_key(client->get_name());
+                out.append("]\n");
+              }
+              clients_written.insert(client->get_name());
+            }
+            if (json) {
+              out.append(ports_written.size() == 1 ? "" : ",");
+              out.json_string(port->get_name());
+              out.append(":[");
+            } else {
+              out.toml_key(port->get_name());
+              out.append(" = [ ");
+            }
+          } else {
+            out.append(json ? "," : ", ");
+          }
+          first = false;
+
+          auto dest = fmt::format("{}:{}", conn.client_name_, conn.port_name_);
+          if (!has_attributes(conn)) {
+            out.toml_string(dest);
+          } else if (json) {
+            out.append("{\"dest\":");
+            out.json_string(dest);
+            write_attributes(conn.queue_, conn.exclusive_, conn.time_update_,
+                             conn.time_real_, format);
+            out.append("}");
+          } else {
+            out.append("{ dest = ");
+            out.toml_string(dest);
+            write_attributes(conn.queue_, conn.exclusive_, conn.time_update_,
+                             conn.time_real_, format);
+            out.append(" }");
+          }
+        }
+        if (!first) {
+          out.append(json ? "]" : " ]\n");
+        }
+      }
+    }
+    if (json) {
+      out.append(clients_written.empty() ? "}\n" : "}\n}\n");
+    }
+    out.flush();
+  }
+
+  /*
+   * look for loops, the busiest ports and connections listed twice in the
+   * live connections, or in the ones of a TOML file if filename is given.
+   * a port that passes on what it receives, like Midi Through or a bridge
+   * looped back by cable, sends events around a loop forever. dot prints
+   * the graph for Graphviz with the loops in red. returns 1 if there is a
+   * loop
+   */
+  int analyze(const char *filename, output_format format = FORMAT_TEXT) {
+    std::vector<Edge> edges;
+    if (filename != nullptr) {
+      std::vector<Route> routes;
+      if (read_profile(filename, routes) != 0) {
+        return 1;
+      }
+      auto span = phase("resolve");
+      for (auto &route : routes) {
+        if (resolve_route(route) == 0) {
+          edges.push_back({route.sender_addr, route.dest_addr});
+        }
+      }
+    } else {
+      auto span = phase("scan");
+      live_edges(edges, false);
+    }
+
+    auto span = phase("analyze");
+    Graph graph(edges);
+    auto component = find_components(graph);
+    auto loops = find_loops(graph, component);
+
+    if (format == FORMAT_DOT) {
+      write_dot(graph, edges, component, loops);
+      return loops.empty() ? 0 : 1;
+    }
+
+    size_t ports = graph.size();
+    // the sequencer refuses a second identical subscription, so live ones
+    // only show up if the snapshot was taken while connections changed.
+    // a sender's connections are together in the graph, so each target
+    // only has to remember the last sender it was counted for
+    std::vector<uint32_t> counted_for(ports, UINT32_MAX);
+    std::vector<int> times(ports, 0);
+    std::vector<std::pair<Edge, int>> duplicates;
+    for (uint32_t node = 0; node < ports; node++) {
+      auto begin = graph.targets.begin() + graph.offsets[node];
+      auto end = graph.targets.begin() + graph.offsets[node + 1];
+      for (auto target = begin; target != end; target++) {
+        if (counted_for[*target] != node) {
+          counted_for[*target] = node;
+          times[*target] = 0;
+        }
+        times[*target]++;
+      }
+      for (auto target = begin; target != end; target++) {
+        if (times[*target] > 1) {
+          duplicates.push_back(
+              {{graph.ports[node], graph.ports[*target]}, times[*target]});
+          times[*target] = 0;
+        }
+      }
+    }
+
+    std::vector<int> fan_in(ports, 0);
+    for (auto target : graph.targets) {
+      fan_in[target]++;
+    }
+    auto busiest = [&](const char *what, auto degree) {
+      int most = 0, count = 0;
+      uint32_t first = 0;
+      for (uint32_t node = 0; node < ports; node++) {
+        if (degree(node) > most) {
+          most = degree(node);
+          first = node;
+          count = 0;
+        }
+        count += degree(node) == most;
+      }
+      out.print("max {}: {}", what, most);
+      if (most > 0) {
+        out.print(" ({}", port_label(graph.ports[first]));
+        if (count > 1) {
+          out.print(" and {} more", count - 1);
+        }
+        out.append(")");
+      }
+      out.append("\n");
+    };
+
+    out.print("ports: {}\nconnections: {}\n", ports, edges.size());
+    busiest("fan-out", [&](uint32_t node) {
+      return (int)(graph.offsets[node + 1] - graph.offsets[node]);
+    });
+    busiest("fan-in", [&](uint32_t node) { return fan_in[node]; });
+    out.print("duplicates: {}\n", duplicates.size());
+    for (auto &[edge, count] : duplicates) {
+      out.print("  {} -> {} ({} times)\n", port_label(edge.sender),
+                port_label(edge.dest), count);
+    }
+    out.print("loops: {}\n", loops.size());
+    for (auto &loop : loops) {
+      out.print("  {}\n", describe_loop(graph, loop));
+    }
+    out.flush();
+    return loops.empty() ? 0 : 1;
+  }
+
+  /*
+   * restore connections from a TOML file. each subscription is confirmed by
+   * its PORT_SUBSCRIBED announcement; routes that are not confirmed within
+   * timeout_ms are reported as timed out
+   */
+  int deserialize_connections(char *filename, bool remove_prev = true,
+                              int timeout_ms = 1000) {
+    std::vector<Route> routes;
+    if (read_profile(filename, routes) != 0) {
+      return 1;
+    }
+    return restore_routes(routes, true, remove_prev, timeout_ms);
+  }
+
+  /*
+   * bring the live connections in line with a TOML file by only removing
+   * the exported connections the file does not list and adding the ones
+   * that are missing. connections that already match are left untouched
+   */
+  int reconcile_connections(char *filename, int timeout_ms = 1000) {
+    std::vector<Route> routes;
+    if (read_profile(filename, routes) != 0) {
+      return 1;
+    }
+    return reconcile_routes(routes, true, timeout_ms);
+  }
+
+  /*
+   * connect and disconnect the lines of filename ("-" for stdin) in one go.
+   * each line is "[-d] [-e] [-r QUEUE | -t QUEUE] SENDER DEST" with the
+   * flags meaning what they do on the command line, and blank lines and
+   * lines starting with '#' are skipped. every line is resolved against the
+   * same snapshot before anything is applied. with atomic nothing is applied
+   * unless every line resolves, and a failing line undoes the ones applied
+   * before it
+   */
+  int apply_batch(const char *filename, bool atomic = false) {
+    std::vector<BatchLine> lines;
+    if (read_batch(filename, lines) != 0) {
+      return 1;
+    }
+
+    int failures = 0;
+    std::optional<Trace::Scope> resolve_span(std::in_place, trace, "resolve");
+    for (auto &line : lines) {
+      if (line.state == pending &&
+          (parse_address(&line.sender_addr, line.sender) < 0 ||
+           parse_address(&line.dest_addr, line.dest) < 0)) {
+        std::cerr << "line " << line.number << ": can't resolve "
+                  << line.sender << " -> " << line.dest << "\n";
+        line.state = failed;
+      }
+      failures += line.state == failed;
+    }
+    resolve_span.reset();
+
+    return apply_lines(lines, failures, atomic);
+  }
+
+  /*
+   * connect or disconnect every port matching send_pattern with every port
+   * matching dest_pattern, paired as pair says. a pattern is
+   * "CLIENT:PORT" with a glob, or a regular expression when regex is set,
+   * for each name. an empty client matches every client, a missing port
+   * every port, and a number the client or port of that number. either part
+   * can be quoted to hold a ':'. connections that are already in place, or
+   * for disconnecting not in place, are left out. with dry_run the
+   * connections are only printed
+   */
+  int fan_out(const char *send_pattern, const char *dest_pattern,
+              bool disconnect, bool regex, pairing pair, bool dry_run,
+              bool atomic, int queue = 0, int exclusive = 0,
+              int convert_time = 0, int convert_real = 0) {
+    std::vector<Port *> senders, receivers;
+    {
+      auto span = phase("resolve");
+      PortPattern sender, receiver;
+      if (compile_pattern(send_pattern, regex, sender) != 0 ||
+          compile_pattern(dest_pattern, regex, receiver) != 0) {
+        return 1;
+      }
+      match_ports(sender, SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                  senders);
+      match_ports(receiver,
+                  SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                  receivers);
+    }
+    for (auto [ports, pattern] :
+         {std::make_pair(&senders, send_pattern),
+          std::make_pair(&receivers, dest_pattern)}) {
+      if (ports->empty()) {
+        std::cerr << "no port matches '" << pattern << "'\n";
+        return 1;
+      }
+    }
+    if (pair == PAIR_ALL_TO_ONE && receivers.size() != 1) {
+      std::cerr << "'" << dest_pattern << "' matches " << receivers.size()
+                << " ports instead of one\n";
+      return 1;
+    }
+    if (pair == PAIR_ONE_TO_ALL && senders.size() != 1) {
+      std::cerr << "'" << send_pattern << "' matches " << senders.size()
+                << " ports instead of one\n";
+      return 1;
+    }
+    if (pair == PAIR_ZIP && senders.size() != receivers.size()) {
+      std::cerr << "can't zip " << senders.size() << " senders with "
+                << receivers.size() << " receivers\n";
+      return 1;
+    }
+
+    std::vector<BatchLine> lines;
+    int skipped = 0;
+    auto add = [&](Port *sender, Port *receiver) {
+      if (sender == receiver) {
+        return;
+      }
+      auto &conns = sender->get_connections();
+      bool connected =
+          std::any_of(conns.begin(), conns.end(), [&](const Connection &conn) {
+            return conn.client_id_ == receiver->get_client_id() &&
+                   conn.port_id_ == receiver->get_index();
+          });
+      if (connected != disconnect) {
+        skipped++;
+        return;
+      }
+      lines.push_back(
+          {0, disconnect,
+           fmt::format("{}:{}", sender->get_client_name(), sender->get_name()),
+           fmt::format("{}:{}", receiver->get_client_name(),
+                       receiver->get_name()),
+           queue, exclusive, convert_time, convert_real,
+           {(unsigned char)sender->get_client_id(),
+            (unsigned char)sender->get_index()},
+           {(unsigned char)receiver->get_client_id(),
+            (unsigned char)receiver->get_index()},
+           pending});
+    };
+    if (pair == PAIR_ZIP) {
+      for (size_t i = 0; i < senders.size(); i++) {
+        add(senders[i], receivers[i]);
+      }
+    } else {
+      for (auto sender : senders) {
+        for (auto receiver : receivers) {
+          add(sender, receiver);
+        }
+      }
+    }
+
+    if (dry_run) {
+      for (auto &line : lines) {
+        std::cout << (disconnect ? "- " : "+ ") << line.sender << " -> "
+                  << line.dest << "\n";
+      }
+      std::cout << lines.size() << " connections to "
+                << (disconnect ? "remove" : "make") << ", " << skipped
+                << (disconnect ? " not connected" : " already connected")
+                << " (dry run)\n";
+      return 0;
+    }
+    if (skipped > 0) {
+      std::cout << skipped
+                << (disconnect ? " not connected\n" : " already connected\n");
+    }
+    if (lines.empty()) {
+      return 0;
+    }
+    return apply_lines(lines, 0, atomic, "connections");
+  }
+
+  /*
+   * put the exported connections into the profile store under name,
+   * replacing a profile of the same name
+   */
+  int save_profile(const char *store_path, std::string_view name) {
+    std::vector<Route> routes;
+    {
+      auto span = phase("serialize");
+      for (auto client : *get_clients()) {
+        for (auto port : *client->get_ports()) {
+          for (auto &conn : port->get_connections()) {
+            if (is_exported(conn)) {
+              routes.push_back(
+                  {fmt::format("{}:{}", client->get_name(), port->get_name()),
+                   fmt::format("{}:{}", conn.client_name_, conn.port_name_),
+                   {}, {}, confirmed, conn.queue_, conn.exclusive_,
+                   conn.time_update_, conn.time_real_});
+            }
+          }
+        }
+      }
+    }
+    uint32_t stored;
+    if (store_profile(store_path, name, routes, stored) != 0) {
+      return 1;
+    }
+    std::cout << "saved " << stored << " connections as '" << name << "'\n";
+    return 0;
+  }
+
+  /*
+   * put the connections of a TOML file into the profile store under name
+   */
+  int import_profile(const char *store_path, std::string_view name,
+                     char *filename) {
+    std::vector<Route> routes;
+    uint32_t stored;
+    if (read_profile(filename, routes) != 0 ||
+        store_profile(store_path, name, routes, stored) != 0) {
+      return 1;
+    }
+    std::cout << "imported " << stored << " connections as '" << name
+              << "'\n";
+    return 0;
+  }
+
+  /*
+   * write a stored profile out in the TOML format read by -S
+   */
+  int export_profile(const char *store_path, std::string_view name) {
+    ProfileStore store;
+    const ProfileStore::Profile *profile;
+    const ProfileStore::Edge *edges;
+    if (find_profile(store, store_path, name, profile, edges) != 0) {
+      return 1;
+    }
+
+    // senders are "client:port" addresses, group them back into tables
+    struct Sender {
+      std::string client;
+      std::string port;
+      uint32_t index;
+    };
+    std::vector<Sender> senders;
+    char scratch[128];
+    for (uint32_t i = 0; i < profile->edge_count; i++) {
+      if (i == 0 || edges[i].sender != edges[i - 1].sender) {
+        std::string_view client, port;
+        auto address = store.string(edges[i].sender);
+        if (!split_address(address, client, port, scratch, sizeof(scratch))) {
+          client = address;
+          port = {};
+        }
+        senders.push_back({std::string(client), std::string(port), i});
+      }
+    }
+    std::sort(senders.begin(), senders.end(),
+                     [](const Sender &a, const Sender &b) {
+                       return a.client != b.client ? a.client < b.client
+                                                   : a.port < b.port;
+                     });
+
+    for (size_t i = 0; i < senders.size(); i++) {
+      if (i == 0 || senders[i].client != senders[i - 1].client) {
+        out.append(i == 0 ? "[" : "\n[");
+        out.toml_key(senders[i].client);
+        out.append("]\n");
+      }
+      out.toml_key(senders[i].port);
+      out.append(" = [ ");
+      for (auto edge = &edges[senders[i].index];
+           edge < edges + profile->edge_count &&
+           edge->sender == edges[senders[i].index].sender;
+           edge++) {
+        if (edge != &edges[senders[i].index]) {
+          out.append(", ");
+        }
+        if (!edge->exclusive && !edge->convert_time && edge->queue == 0) {
+          out.toml_string(store.string(edge->dest));
+          continue;
+        }
+        out.append("{ dest = ");
+        out.toml_string(store.string(edge->dest));
+        write_attributes(edge->queue, edge->exclusive, edge->convert_time,
+                         edge->convert_real, FORMAT_TEXT);
+        out.append(" }");
+      }
+      out.append(" ]\n");
+    }
+    out.flush();
+    return 0;
+  }
+
+  int list_profiles(const char *store_path) {
+    ProfileStore store;
+    if (store.open(store_path) != 0) {
+      return 1;
+    }
+    for (size_t i = 0; i < store.size(); i++) {
+      auto &profile = store.profile(i);
+      out.print("{} ({} connections)\n", store.string(profile.name),
+                profile.edge_count);
+    }
+    out.flush();
+    return 0;
+  }
+
+  /*
+   * restore a stored profile like -S, or like -S --reconcile. each address
+   * is looked up once however many connections mention it, and nothing is
+   * parsed besides the addresses themselves
+   */
+  int load_profile(const char *store_path, std::string_view name,
+                   bool reconcile = false, int timeout_ms = 1000) {
+    ProfileStore store;
+    const ProfileStore::Profile *profile;
+    const ProfileStore::Edge *edges;
+    {
+      auto span = phase("read_profile");
+      if (find_profile(store, store_path, name, profile, edges) != 0) {
+        return 1;
+      }
+    }
+
+    std::vector<Route> routes;
+    routes.reserve(profile->edge_count);
+    std::optional<Trace::Scope> resolve_span(std::in_place, trace, "resolve");
+    // by string number: 0 not looked up yet, 1 found, -1 not found
+    std::vector<signed char> found(store.string_count(), 0);
+    std::vector<snd_seq_addr_t> addrs(store.string_count());
+    auto lookup = [&](uint32_t id, const char *what) {
+      if (found[id] == 0) {
+        found[id] = parse_address(&addrs[id], store.string(id)) < 0 ? -1 : 1;
+        if (found[id] < 0) {
+          std::cerr << "invalid " << what << " address '" << store.string(id)
+                    << "'\n";
+        }
+      }
+      return found[id] > 0;
+    };
+    for (uint32_t i = 0; i < profile->edge_count; i++) {
+      auto &edge = edges[i];
+      bool resolved =
+          lookup(edge.sender, "sender") && lookup(edge.dest, "destination");
+      routes.push_back({std::string(store.string(edge.sender)),
+                        std::string(store.string(edge.dest)),
+                        addrs[edge.sender], addrs[edge.dest],
+                        resolved ? pending : failed, edge.queue,
+                        edge.exclusive, edge.convert_time, edge.convert_real});
+    }
+    resolve_span.reset();
+
+    return reconcile ? reconcile_routes(routes, false, timeout_ms)
+                     : restore_routes(routes, false, true, timeout_ms);
+  }
+
+private:
+  enum route_state { pending, confirmed, timed_out, failed };
+
+  /*
+   * a connection listed in a TOML profile
+   */
+  struct Route {
+    std::string sender;
+    std::string dest;
+    snd_seq_addr_t sender_addr;
+    snd_seq_addr_t dest_addr;
+    route_state state;
+    int queue = 0;
+    int exclusive = 0;
+    int convert_time = 0;
+    int convert_real = 0;
+  };
+
+  /*
+   * a line of a --batch file
+   */
+  struct BatchLine {
+    int number;
+    bool disconnect;
+    std::string sender;
+    std::string dest;
+    int queue;
+    int exclusive;
+    int convert_time;
+    int convert_real;
+    snd_seq_addr_t sender_addr;
+    snd_seq_addr_t dest_addr;
+    route_state state;
+  };
+
+  std::unique_ptr<Backend> backend;
+  // inactive unless a listing asks for one
+  PortFilter filter;
+  // declared in this order so clients release their ports before the port
+  // pool goes away
+  NamePool names;
+  ObjectPool<Port> port_pool;
+  ObjectPool<Client> client_pool;
+  std::vector<Client *> clients;
+  bool clients_loaded = false;
+  // also holds clients resolved by number before the full list was needed
+  std::unordered_map<int, Client *> clients_by_index;
+  // name keys view interned names
+  std::unordered_map<std::string_view, Client *> clients_by_name;
+  // port names across all clients, nullptr where a name is not unique
+  std::unordered_map<std::string_view, Port *> ports_by_name;
+  bool ports_indexed = false;
+  // private port subscribed to System:Announce, -1 until needed
+  int announce_port = -1;
+  bool client_name_set = false;
+  int apply_threads = 1;
+  bool refuse_cycles = false;
+  uint64_t generation = 0;
+  bool inbound_indexed = false;
+  // handles opened by check_topology, by the number of them still to exit
+  std::unordered_map<int, int> checker_clients;
+  // listings are buffered here and written out in one go
+  Writer out;
+  // phase timings for --stats and --trace, nullptr when not wanted
+  Trace *trace = nullptr;
+
+  /*
+   * connections to these ports are bookkeeping of other programs and are
+   * never saved or restored
+   */
+  static bool is_exported(const Connection &conn) {
+    return conn.port_name_.compare("Network Export") &&
+           conn.port_name_.compare("Announcements");
+  }
+
+  /*
+   * whether reconciling may remove a live connection. this follows
+   * remove_connection, but also leaves System ports alone since their
+   * subscribers are other programs listening for timer and announce events
+   */
+  bool is_removable(const snd_seq_addr_t &sender, const Connection &conn) {
+    if (sender.client == SND_SEQ_CLIENT_SYSTEM || !is_exported(conn)) {
+      return false;
+    }
+    auto client = find_client(conn.client_id_);
+    auto port = client ? client->find_port(conn.port_id_) : nullptr;
+    return port && (port->get_capability() & SND_SEQ_PORT_CAP_SUBS_WRITE) &&
+           !(port->get_capability() & SND_SEQ_PORT_CAP_NO_EXPORT);
+  }
+
+  int read_profile(const char *filename, std::vector<Route> &routes) {
+    auto span = phase("read_profile");
+    toml::table tbl;
+    try {
+      tbl = toml::parse_file(filename);
+    } catch (const toml::parse_error &err) {
+      std::cerr << "TOML parsing failed:\n" << err << "\n";
+      return 1;
+    }
+
+    for (auto client : tbl) {
+      auto client_name = std::string(client.first);
+      auto ports = client.second.as_table();
+      if (ports == nullptr) {
+        continue;
+      }
+      for (auto port : *ports) {
+        auto port_name = std::string(port.first);
+        auto connections = port.second.as_array();
+        if (connections == nullptr) {
+          continue;
+        }
+        auto send_addr = fmt::format("{}:{}", client_name, port_name);
+        for (auto &elem : *connections) {
+          Route route{send_addr, {}, {}, {}, failed};
+          if (auto dest = elem.as_string()) {
+            route.dest = dest->get();
+          } else if (elem.as_table() == nullptr ||
+                     read_attributes(*elem.as_table(), route) != 0) {
+            std::cerr << "invalid connection from '" << send_addr << "'\n";
+            continue;
+          }
+          routes.push_back(std::move(route));
+        }
+      }
+    }
+    return 0;
+  }
+
+  /*
+   * the part of deserialize_connections after reading the file. resolve is
+   * false for routes whose addresses were already looked up
+   */
+  int restore_routes(std::vector<Route> &routes, bool resolve,
+                     bool remove_prev = true, int timeout_ms = 1000) {
+    if (resolve) {
+      auto span = phase("resolve");
+      for (auto &route : routes) {
+        resolve_route(route);
+      }
+    }
+    // checked before anything is removed
+    if (refuse_cycles && would_loop(routes, remove_prev)) {
+      return 1;
+    }
+
+    if (open_announce_port() < 0) {
+      return 1;
+    }
+
+    if (remove_prev) {
+      remove_all_connections();
+    }
+
+    subscribe_routes(routes, timeout_ms);
+
+    int counts[4] = {0, 0, 0, 0};
+    for (auto &route : routes) {
+      counts[route.state]++;
+      report_route(route);
+    }
+    std::cout << "restored " << counts[confirmed] << " of " << routes.size()
+              << " connections (" << counts[confirmed] << " confirmed, "
+              << counts[timed_out] << " timed out, " << counts[failed]
+              << " failed)\n";
+
+    return counts[timed_out] + counts[failed] > 0 ? 1 : 0;
+  }
+
+  /*
+   * the part of reconcile_connections after reading the file. resolve is
+   * false for routes whose addresses were already looked up
+   */
+  int reconcile_routes(std::vector<Route> &routes, bool resolve,
+                       int timeout_ms = 1000) {
+    // desired edges, by edge key
+    std::unordered_map<uint32_t, size_t> desired;
+    std::optional<Trace::Scope> resolve_span(std::in_place, trace, "resolve");
+    for (size_t i = 0; i < routes.size(); i++) {
+      if (resolve) {
+        resolve_route(routes[i]);
+      }
+      if (routes[i].state == pending) {
+        auto key = edge_key(routes[i].sender_addr, routes[i].dest_addr);
+        if (!desired.emplace(key, i).second) {
+          // listed twice, only act on it once
+          routes[i].state = confirmed;
+        }
+      }
+    }
+
+    resolve_span.reset();
+
+    if (refuse_cycles && would_loop(routes, true)) {
+      return 1;
+    }
+
+    std::vector<Route> removed;
+    int unchanged = 0;
+    std::optional<Trace::Scope> diff_span(std::in_place, trace, "diff");
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        for (auto &conn : port->get_connections()) {
+          snd_seq_addr_t sender = {(unsigned char)port->get_client_id(),
+                                   (unsigned char)port->get_index()};
+          snd_seq_addr_t dest = {(unsigned char)conn.client_id_,
+                                 (unsigned char)conn.port_id_};
+          auto it = desired.find(edge_key(sender, dest));
+          if (it != desired.end() &&
+              (same_attributes(routes[it->second], conn) ||
+               !is_removable(sender, conn))) {
+            routes[it->second].state = confirmed;
+            unchanged++;
+          } else if (is_removable(sender, conn)) {
+            // either not listed, or listed with other attributes and added
+            // back below
+            removed.push_back(
+                {fmt::format("{}:{}", client->get_name(), port->get_name()),
+                 fmt::format("{}:{}", conn.client_name_, conn.port_name_),
+                 sender, dest, pending});
+          }
+        }
+      }
+    }
+
+    diff_span.reset();
+
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+    std::optional<Trace::Scope> unsubscribe_span(std::in_place, trace,
+                                                 "unsubscribe");
+    auto record = [&](Route &route, int err) {
+      if (err < 0) {
+        std::cerr << "disconnection failed (" << snd_strerror(err) << ")\n";
+      }
+      route.state = err < 0 ? failed : confirmed;
+    };
+    // remove first so exclusive ports are free for the new connections
+    if (apply_threads > 1) {
+      std::vector<size_t> indices(removed.size());
+      std::iota(indices.begin(), indices.end(), 0);
+      auto errors = apply_parallel(removed, indices, true,
+                                   [](const snd_seq_event_t *) {});
+      for (size_t i = 0; i < removed.size(); i++) {
+        record(removed[i], errors[i]);
+      }
+    } else {
+      for (auto &route : removed) {
+        snd_seq_port_subscribe_set_sender(subs, &route.sender_addr);
+        snd_seq_port_subscribe_set_dest(subs, &route.dest_addr);
+        int err = backend->get_subscription(subs);
+        if (err == 0) {
+          err = backend->unsubscribe(subs);
+        }
+        record(route, err);
+      }
+    }
+    unsubscribe_span.reset();
+
+    std::vector<size_t> to_add;
+    for (size_t i = 0; i < routes.size(); i++) {
+      if (routes[i].state == pending) {
+        to_add.push_back(i);
+      }
+    }
+    // only listen for announcements if there is something to wait for
+    if (!to_add.empty() && open_announce_port() < 0) {
+      return 1;
+    }
+    subscribe_routes(routes, timeout_ms);
+
+    int counts[4] = {0, 0, 0, 0};
+    int removed_ok = 0, added_ok = 0;
+    for (auto &route : removed) {
+      if (route.state == confirmed) {
+        std::cout << "- " << route.sender << " -> " << route.dest << "\n";
+        removed_ok++;
+      } else {
+        std::cerr << "failed to remove: " << route.sender << " -> "
+                  << route.dest << "\n";
+        counts[failed]++;
+      }
+    }
+    for (auto i : to_add) {
+      if (routes[i].state == confirmed) {
+        std::cout << "+ " << routes[i].sender << " -> " << routes[i].dest
+                  << "\n";
+        added_ok++;
+      }
+    }
+    for (auto &route : routes) {
+      counts[route.state]++;
+      report_route(route);
+    }
+    std::cout << "reconciled " << routes.size() << " connections ("
+              << unchanged << " unchanged, " << added_ok << " added, "
+              << removed_ok << " removed, " << counts[timed_out]
+              << " timed out, " << counts[failed] << " failed)\n";
+
+    return counts[timed_out] + counts[failed] > 0 ? 1 : 0;
+  }
+
+  /*
+   * apply resolved batch lines in order, the part of --batch after reading
+   * and resolving them. failures counts the lines that already failed to
+   * resolve, unit is what the lines are called in the summary
+   */
+  int apply_lines(std::vector<BatchLine> &lines, int failures, bool atomic,
+                  const char *unit = "lines") {
+    if (atomic && failures > 0) {
+      std::cout << "applied 0 of " << lines.size() << " " << unit << "\n";
+      return 1;
+    }
+    if (set_client_name() != 0) {
+      return 1;
+    }
+
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+    std::optional<Trace::Scope> apply_span(std::in_place, trace, "apply");
+    size_t applied = 0;
+    for (; applied < lines.size(); applied++) {
+      auto &line = lines[applied];
+      if (line.state != pending) {
+        continue;
+      }
+      set_subscription(subs, line);
+      int err;
+      if (line.disconnect) {
+        err = backend->get_subscription(subs);
+        if (err < 0) {
+          std::cerr << label(line) << ": no subscription is found\n";
+        } else {
+          // remember what was removed so it can be put back as it was
+          line.queue = snd_seq_port_subscribe_get_queue(subs);
+          line.exclusive = snd_seq_port_subscribe_get_exclusive(subs);
+          line.convert_time = snd_seq_port_subscribe_get_time_update(subs);
+          line.convert_real = snd_seq_port_subscribe_get_time_real(subs);
+          err = backend->unsubscribe(subs);
+          if (err < 0) {
+            std::cerr << label(line) << ": disconnection failed ("
+                      << snd_strerror(err) << ")\n";
+          }
+        }
+      } else {
+        err = subscribe_port(subs);
+        if (err == -EEXIST) {
+          std::cerr << label(line) << ": connection is already subscribed\n";
+        } else if (err < 0) {
+          std::cerr << label(line) << ": connection failed ("
+                    << snd_strerror(err) << ")\n";
+        }
+      }
+      line.state = err < 0 ? failed : confirmed;
+      if (err < 0) {
+        failures++;
+        if (atomic) {
+          break;
+        }
+      }
+    }
+    apply_span.reset();
+
+    if (atomic && failures > 0) {
+      auto span = phase("rollback");
+      size_t undone = 0;
+      while (applied-- > 0) {
+        auto &line = lines[applied];
+        if (line.state != confirmed) {
+          continue;
+        }
+        set_subscription(subs, line);
+        int err = line.disconnect ? backend->subscribe(subs)
+                                  : backend->unsubscribe(subs);
+        if (err < 0) {
+          std::cerr << label(line) << ": can't roll back ("
+                    << snd_strerror(err) << ")\n";
+        } else {
+          undone++;
+        }
+      }
+      std::cout << "applied 0 of " << lines.size() << " " << unit << " ("
+                << undone << " rolled back)\n";
+      return 1;
+    }
+
+    int connected = 0, disconnected = 0;
+    for (auto &line : lines) {
+      if (line.state == confirmed) {
+        std::cout << (line.disconnect ? "- " : "+ ") << line.sender << " -> "
+                  << line.dest << "\n";
+        (line.disconnect ? disconnected : connected)++;
+      }
+    }
+    std::cout << "applied " << connected + disconnected << " of "
+              << lines.size() << " " << unit << " (" << connected
+              << " connected, "
+              << disconnected << " disconnected, " << failures
+              << " failed)\n";
+
+    return failures > 0 ? 1 : 0;
+  }
+
+  // how a batch line is referred to in messages
+  static std::string label(const BatchLine &line) {
+    if (line.number > 0) {
+      return fmt::format("line {}", line.number);
+    }
+    return fmt::format("{} -> {}", line.sender, line.dest);
+  }
+
+  int read_batch(const char *filename, std::vector<BatchLine> &lines) {
+    auto span = phase("read_batch");
+    std::ifstream file;
+    bool from_stdin = strcmp(filename, "-") == 0;
+    if (!from_stdin) {
+      file.open(filename);
+      if (!file) {
+        std::cerr << "can't open '" << filename << "'\n";
+        return 1;
+      }
+    }
+    std::istream &in = from_stdin ? std::cin : file;
+
+    std::string text;
+    std::vector<std::string_view> words;
+    for (int number = 1; std::getline(in, text); number++) {
+      if (!split_words(text, words)) {
+        std::cerr << "line " << number << ": unterminated quote\n";
+        lines.push_back({number, false, text, {}, 0, 0, 0, 0, {}, {}, failed});
+        continue;
+      }
+      if (words.empty() || words[0][0] == '#') {
+        continue;
+      }
+
+      BatchLine line{number, false, {}, {}, 0, 0, 0, 0, {}, {}, pending};
+      std::vector<std::string_view> addresses;
+      for (size_t i = 0; i < words.size() && line.state == pending; i++) {
+        auto word = words[i];
+        if (word[0] != '-') {
+          addresses.push_back(word);
+        } else if (word == "-d" || word == "--disconnect") {
+          line.disconnect = true;
+        } else if (word == "-e" || word == "--exclusive") {
+          line.exclusive = 1;
+        } else if (word == "-r" || word == "--real" || word == "-t" ||
+                   word == "--tick") {
+          if (i + 1 == words.size() || !parse_number(words[++i], line.queue)) {
+            std::cerr << "line " << number << ": " << word
+                      << " needs a queue number\n";
+            line.state = failed;
+          }
+          line.convert_time = 1;
+          line.convert_real = word == "-r" || word == "--real";
+        } else {
+          std::cerr << "line " << number << ": unknown option '" << word
+                    << "'\n";
+          line.state = failed;
+        }
+      }
+      if (line.state == pending && addresses.size() != 2) {
+        std::cerr << "line " << number << ": expected a sender and a receiver\n";
+        line.state = failed;
+      }
+      if (line.state == pending) {
+        line.sender = addresses[0];
+        line.dest = addresses[1];
+      } else {
+        line.sender = text;
+      }
+      lines.push_back(std::move(line));
+    }
+    return 0;
+  }
+
+  /*
+   * split a line at unquoted whitespace. quotes and escapes are kept in the
+   * words so that parse_address sees them as it would on the command line
+   */
+  static bool split_words(std::string_view text,
+                          std::vector<std::string_view> &words) {
+    words.clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+      if (isspace((unsigned char)text[pos])) {
+        pos++;
+        continue;
+      }
+      size_t begin = pos;
+      char quote = 0;
+      for (; pos < text.size(); pos++) {
+        char c = text[pos];
+        if (c == '\\') {
+          if (++pos == text.size()) {
+            return false;
+          }
+        } else if (quote) {
+          quote = c == quote ? 0 : quote;
+        } else if (c == '\'' || c == '"') {
+          quote = c;
+        } else if (isspace((unsigned char)c)) {
+          break;
+        }
+      }
+      if (quote) {
+        return false;
+      }
+      words.push_back(text.substr(begin, pos - begin));
+    }
+    return true;
+  }
+
+  // fill in a subscription from a Route or a BatchLine
+  template <typename Entry>
+  static void set_subscription(snd_seq_port_subscribe_t *subs,
+                               const Entry &entry) {
+    snd_seq_port_subscribe_set_sender(subs, &entry.sender_addr);
+    snd_seq_port_subscribe_set_dest(subs, &entry.dest_addr);
+    snd_seq_port_subscribe_set_queue(subs, entry.queue);
+    snd_seq_port_subscribe_set_exclusive(subs, entry.exclusive);
+    snd_seq_port_subscribe_set_time_update(subs, entry.convert_time);
+    snd_seq_port_subscribe_set_time_real(subs, entry.convert_real);
+  }
+
+  /*
+   * the {dest, exclusive, queue, time} table form of a connection
+   */
+  static int read_attributes(toml::table &attrs, Route &route) {
+    auto dest = attrs.get("dest");
+    if (dest == nullptr || !dest->value<std::string>()) {
+      return 1;
+    }
+    route.dest = *dest->value<std::string>();
+    if (auto exclusive = attrs.get("exclusive")) {
+      if (!exclusive->value<bool>()) {
+        return 1;
+      }
+      route.exclusive = *exclusive->value<bool>();
+    }
+    if (auto queue = attrs.get("queue")) {
+      if (!queue->value<int>()) {
+        return 1;
+      }
+      route.queue = *queue->value<int>();
+    }
+    if (auto time = attrs.get("time")) {
+      auto mode = time->value<std::string>();
+      if (!mode || (*mode != "real" && *mode != "tick")) {
+        return 1;
+      }
+      route.convert_time = 1;
+      route.convert_real = *mode == "real";
+    }
+    return 0;
+  }
+
+  static bool has_attributes(const Connection &conn) {
+    return conn.exclusive_ || conn.time_update_ || conn.queue_ != 0;
+  }
+
+  // a profile entry asks for exactly the attributes a live connection has
+  static bool same_attributes(const Route &route, const Connection &conn) {
+    return (bool)route.exclusive == conn.exclusive_ &&
+           (bool)route.convert_time == conn.time_update_ &&
+           (!route.convert_time || (bool)route.convert_real == conn.time_real_) &&
+           route.queue == conn.queue_;
+  }
+
+  /*
+   * the non-default attributes of a connection as further members of the
+   * table or object it is written in
+   */
+  void write_attributes(int queue, bool exclusive, bool time_update,
+                        bool time_real, output_format format) {
+    bool json = format != FORMAT_TEXT;
+    if (exclusive) {
+      out.append(json ? ",\"exclusive\":true" : ", exclusive = true");
+    }
+    if (time_update || queue != 0) {
+      out.print(json ? ",\"queue\":{}" : ", queue = {}", queue);
+    }
+    if (time_update) {
+      out.append(time_real
+                     ? (json ? ",\"time\":\"real\"" : ", time = \"real\"")
+                     : (json ? ",\"time\":\"tick\"" : ", time = \"tick\""));
+    }
+  }
+
+  /*
+   * open the store and find a profile with valid edges in it
+   */
+  static int find_profile(ProfileStore &store, const char *store_path,
+                          std::string_view name,
+                          const ProfileStore::Profile *&profile,
+                          const ProfileStore::Edge *&edges) {
+    if (store.open(store_path) != 0) {
+      return 1;
+    }
+    profile = store.find(name);
+    if (profile == nullptr) {
+      std::cerr << "no profile named '" << name << "' in '" << store_path
+                << "'\n";
+      return 1;
+    }
+    edges = store.edges(*profile);
+    if (edges == nullptr) {
+      std::cerr << "profile '" << name << "' in '" << store_path
+                << "' is damaged\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  /*
+   * write the store back with name holding routes and every other profile
+   * as it was. stored is set to the number of connections kept, which is
+   * fewer than routes if some are listed twice
+   */
+  int store_profile(const char *store_path, std::string_view name,
+                    const std::vector<Route> &routes, uint32_t &stored) {
+    ProfileStore store;
+    if (store.open(store_path) != 0) {
+      return 1;
+    }
+    ProfileStore::Builder builder;
+    for (size_t i = 0; i < store.size(); i++) {
+      auto &profile = store.profile(i);
+      if (store.string(profile.name) == name) {
+        continue;
+      }
+      auto edges = store.edges(profile);
+      if (edges == nullptr) {
+        std::cerr << "dropping damaged profile '" << store.string(profile.name)
+                  << "'\n";
+        continue;
+      }
+      builder.add_profile(store.string(profile.name));
+      for (uint32_t j = 0; j < profile.edge_count; j++) {
+        builder.add_edge(store.string(edges[j].sender),
+                         store.string(edges[j].dest), edges[j].queue,
+                         edges[j].exclusive, edges[j].convert_time,
+                         edges[j].convert_real);
+      }
+    }
+    builder.add_profile(name);
+    for (auto &route : routes) {
+      builder.add_edge(route.sender, route.dest, route.queue, route.exclusive,
+                       route.convert_time, route.convert_real);
+    }
+    if (builder.write(store_path) != 0) {
+      return 1;
+    }
+    stored = builder.edge_count(name);
+    return 0;
+  }
+
+  /*
+   * one side of a fan_out, a pattern for the client and one for the port.
+   * a pattern that is a number matches by number instead
+   */
+  struct NamePattern {
+    std::string text;
+    std::optional<std::regex> regex;
+    int number = -1;
+  };
+
+  struct PortPattern {
+    std::optional<NamePattern> client;
+    std::optional<NamePattern> port;
+  };
+
+  static int compile_pattern(std::string_view arg, bool regex,
+                             PortPattern &pattern) {
+    std::string_view client, port;
+    bool has_port;
+    if (!split_pattern(arg, client, port, has_port)) {
+      std::cerr << "invalid pattern '" << arg << "'\n";
+      return 1;
+    }
+    auto compile = [&](std::string_view part, std::optional<NamePattern> &out) {
+      out.emplace();
+      out->text = part;
+      if (parse_number(part, out->number)) {
+        return 0;
+      }
+      out->number = -1;
+      if (regex) {
+        try {
+          out->regex.emplace(out->text, std::regex::ECMAScript);
+        } catch (const std::regex_error &err) {
+          std::cerr << "invalid regular expression '" << part << "' ("
+                    << err.what() << ")\n";
+          return 1;
+        }
+      }
+      return 0;
+    };
+    if ((!client.empty() && compile(client, pattern.client) != 0) ||
+        (has_port && compile(port, pattern.port) != 0)) {
+      return 1;
+    }
+    return 0;
+  }
+
+  static bool name_matches(const NamePattern &pattern, int number,
+                           std::string_view name) {
+    if (pattern.number >= 0) {
+      return pattern.number == number;
+    }
+    if (pattern.regex) {
+      return std::regex_match(name.begin(), name.end(), *pattern.regex);
+    }
+    return glob_match(pattern.text, name);
+  }
+
+  /*
+   * the ports matching pattern that have all of the capability bits, in
+   * client and port order. our own ports are never matched
+   */
+  void match_ports(const PortPattern &pattern, unsigned int capability,
+                   std::vector<Port *> &ports) {
+    int self = backend->client_id();
+    for (auto client : *get_clients()) {
+      if (client->get_index() == self ||
+          (pattern.client && !name_matches(*pattern.client, client->get_index(),
+                                           client->get_name()))) {
+        continue;
+      }
+      for (auto port : *client->get_ports()) {
+        if ((port->get_capability() & capability) == capability &&
+            (!pattern.port || name_matches(*pattern.port, port->get_index(),
+                                           port->get_name()))) {
+          ports.push_back(port);
+        }
+      }
+    }
+  }
+
+  /*
+   * split a pattern at the ':' outside of quotes. unlike split_address, '.'
+   * doesn't split and backslashes are left in place for the pattern syntax.
+   * quotes around a whole part are dropped
+   */
+  static bool split_pattern(std::string_view arg, std::string_view &client,
+                            std::string_view &port, bool &has_port) {
+    // where the part starting at pos ends, npos for an unterminated quote
+    auto part_end = [&](size_t pos) {
+      char quote = 0;
+      for (; pos < arg.size(); pos++) {
+        char c = arg[pos];
+        if (c == '\\') {
+          pos++;
+        } else if (quote) {
+          quote = c == quote ? 0 : quote;
+        } else if (c == '\'' || c == '"') {
+          quote = c;
+        } else if (c == ':') {
+          break;
+        }
+      }
+      return quote ? std::string_view::npos : std::min(pos, arg.size());
+    };
+    auto unquote = [](std::string_view part) {
+      if (part.size() >= 2 && (part[0] == '\'' || part[0] == '"') &&
+          part.back() == part[0]) {
+        return part.substr(1, part.size() - 2);
+      }
+      return part;
+    };
+
+    size_t colon = part_end(0);
+    if (colon == std::string_view::npos) {
+      return false;
+    }
+    client = unquote(arg.substr(0, colon));
+    has_port = colon < arg.size();
+    port = std::string_view();
+    if (has_port) {
+      // a second ':' has to be quoted
+      if (part_end(colon + 1) != arg.size()) {
+        return false;
+      }
+      port = unquote(arg.substr(colon + 1));
+    }
+    return !client.empty() || has_port;
+  }
+
+  /*
+   * shell-style matching of a whole name: '*' for any run of characters,
+   * '?' for one, '[...]' for one of a set or range ('[!...]' or '[^...]'
+   * for none of them), and a backslash for the next character as it is
+   */
+  static bool glob_match(std::string_view pattern, std::string_view name) {
+    size_t p = 0, n = 0;
+    // where to resume after the last '*' if the rest fails to match
+    size_t star = std::string_view::npos, star_n = 0;
+    while (n < name.size()) {
+      if (p < pattern.size() && pattern[p] == '*') {
+        star = p++;
+        star_n = n;
+        continue;
+      }
+      if (p < pattern.size()) {
+        size_t next = p;
+        if (glob_char(pattern, next, name[n])) {
+          p = next;
+          n++;
+          continue;
+        }
+      }
+      if (star == std::string_view::npos) {
+        return false;
+      }
+      p = star + 1;
+      n = ++star_n;
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+      p++;
+    }
+    return p == pattern.size();
+  }
+
+  // whether the pattern element at pos matches c, moving pos past it
+  static bool glob_char(std::string_view pattern, size_t &pos, char c) {
+    char first = pattern[pos++];
+    if (first == '?') {
+      return true;
+    }
+    if (first == '\\' && pos < pattern.size()) {
+      return pattern[pos++] == c;
+    }
+    if (first != '[') {
+      return first == c;
+    }
+    bool negate = pos < pattern.size() &&
+                  (pattern[pos] == '!' || pattern[pos] == '^');
+    size_t i = pos + negate;
+    // as in fnmatch, a ']' first in the set is part of it
+    size_t end = pattern.find(']', i + 1);
+    if (end == std::string_view::npos) {
+      // no closing bracket, a plain '['
+      return c == '[';
+    }
+    bool found = false;
+    for (; i < end; i++) {
+      if (i + 2 < end && pattern[i + 1] == '-') {
+        found = found || (c >= pattern[i] && c <= pattern[i + 2]);
+        i += 2;
+      } else {
+        found = found || c == pattern[i];
+      }
+    }
+    pos = end + 1;
+    return found != negate;
+  }
+
+  /*
+   * look up both ends of a route, leaving it pending if they exist
+   */
+  int resolve_route(Route &route, bool quiet = false) {
+    if (parse_address(&route.sender_addr, route.sender) < 0) {
+      if (!quiet) {
+        std::cerr << "invalid sender address '" << route.sender << "'\n";
+      }
+      route.state = failed;
+      return 1;
+    }
+    if (parse_address(&route.dest_addr, route.dest) < 0) {
+      if (!quiet) {
+        std::cerr << "invalid destination address '" << route.dest << "'\n";
+      }
+      route.state = failed;
+      return 1;
+    }
+    route.state = pending;
+    return 0;
+  }
+
+  /*
+   * subscribe, or remove if unsubscribe is set, the routes at indices on
+   * apply_threads workers with a sequencer handle each, and return the
+   * result of each by route index (-EEXIST if it was already connected).
+   * routes from one sender port are applied in order by the same worker,
+   * and so is everything connecting to a port that an exclusive route goes
+   * to, so each result is the one applying the routes in order would give.
+   * announcements arriving on this handle meanwhile are passed to drain
+   */
+  template <typename Handler>
+  std::vector<int> apply_parallel(const std::vector<Route> &routes,
+                                  const std::vector<size_t> &indices,
+                                  bool unsubscribe, Handler drain) {
+    // union-find over ports, as client << 8 | port
+    std::vector<int> parent(1 << 16);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](int key) {
+      while (parent[key] != key) {
+        key = parent[key] = parent[parent[key]];
+      }
+      return key;
+    };
+    auto port_key = [](const snd_seq_addr_t &addr) {
+      return addr.client << 8 | addr.port;
+    };
+
+    std::vector<char> exclusive_dest(1 << 16, false);
+    for (auto i : indices) {
+      if (routes[i].exclusive) {
+        exclusive_dest[port_key(routes[i].dest_addr)] = true;
+      }
+    }
+    for (auto i : indices) {
+      auto dest = port_key(routes[i].dest_addr);
+      if (exclusive_dest[dest]) {
+        parent[find(port_key(routes[i].sender_addr))] = find(dest);
+      }
+    }
+
+    // routes that have to stay in order, in the order they were listed
+    std::vector<std::vector<size_t>> groups;
+    std::unordered_map<int, size_t> group_index;
+    for (auto i : indices) {
+      auto root = find(port_key(routes[i].sender_addr));
+      auto it = group_index.emplace(root, groups.size()).first;
+      if (it->second == groups.size()) {
+        groups.emplace_back();
+      }
+      groups[it->second].push_back(i);
+    }
+
+    std::vector<int> errors(routes.size(), 0);
+    auto apply = [&](Backend &handle, const std::vector<size_t> &group) {
+      snd_seq_port_subscribe_t *subs;
+      snd_seq_port_subscribe_alloca(&subs);
+      for (auto i : group) {
+        set_subscription(subs, routes[i]);
+        int err = handle.get_subscription(subs);
+        if (unsubscribe) {
+          errors[i] = err == 0 ? handle.unsubscribe(subs) : err;
+        } else {
+          errors[i] = err == 0 ? -EEXIST : handle.subscribe(subs);
+        }
+      }
+    };
+
+    int threads = std::min<int>(apply_threads, groups.size());
+    // groups a worker could not get to are applied here afterwards
+    std::vector<char> applied(groups.size(), false);
+    std::atomic<size_t> next{0};
+    std::atomic<int> running{threads};
+
+    auto worker = [&](int thread) {
+      auto span = phase("apply_worker", thread);
+      auto handle = backend->open_another();
+      if (handle != nullptr && handle->set_client_name("ALSA Connector") >= 0) {
+        for (size_t i; (i = next++) < groups.size();) {
+          apply(*handle, groups[i]);
+          applied[i] = true;
+        }
+      }
+      running--;
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+      workers.emplace_back(worker, i + 1);
+    }
+    // keep the input buffer from overflowing while the workers run
+    while (announce_port >= 0 && running > 0) {
+      wait_announcements(5, [&](const snd_seq_event_t *ev) {
+        drain(ev);
+        return true;
+      });
+    }
+    for (auto &thread : workers) {
+      thread.join();
+    }
+
+    for (size_t i = 0; i < groups.size(); i++) {
+      if (!applied[i]) {
+        apply(*backend, groups[i]);
+      }
+    }
+    return errors;
+  }
+
+  /*
+   * subscribe every pending route and wait for the announcements that
+   * confirm them. the announce port must already be open
+   */
+  void subscribe_routes(std::vector<Route> &routes, int timeout_ms) {
+    // routes waiting for their announcement, by edge key
+    std::unordered_map<uint32_t, size_t> waiting;
+
+    auto confirm = [&](const snd_seq_event_t *ev) {
+      if (ev->type == SND_SEQ_EVENT_PORT_SUBSCRIBED) {
+        auto it = waiting.find(
+            edge_key(ev->data.connect.sender, ev->data.connect.dest));
+        if (it != waiting.end()) {
+          routes[it->second].state = confirmed;
+          waiting.erase(it);
+        }
+      }
+      return !waiting.empty();
+    };
+
+    snd_seq_port_subscribe_t *subs;
+    snd_seq_port_subscribe_alloca(&subs);
+
+    auto record = [&](size_t i, int err) {
+      auto &route = routes[i];
+      if (err == -EEXIST) {
+        route.state = confirmed;
+      } else if (err < 0) {
+        std::cerr << "connection failed (" << snd_strerror(err) << ")\n";
+        route.state = failed;
+      } else {
+        waiting.emplace(edge_key(route.sender_addr, route.dest_addr), i);
+      }
+    };
+
+    std::optional<Trace::Scope> subscribe_span(std::in_place, trace,
+                                               "subscribe");
+    if (apply_threads > 1) {
+      std::vector<size_t> indices;
+      for (size_t i = 0; i < routes.size(); i++) {
+        if (routes[i].state == pending) {
+          indices.push_back(i);
+        }
+      }
+      if (!indices.empty() && set_client_name() != 0) {
+        for (auto i : indices) {
+          routes[i].state = failed;
+        }
+        indices.clear();
+      }
+      // announcements that came in before their route was known to succeed
+      std::vector<snd_seq_event_t> early;
+      auto errors = apply_parallel(routes, indices, false,
+                                   [&](const snd_seq_event_t *ev) {
+                                     if (ev->type ==
+                                         SND_SEQ_EVENT_PORT_SUBSCRIBED) {
+                                       early.push_back(*ev);
+                                     }
+                                   });
+      // failures are reported in the order the routes were listed
+      for (auto i : indices) {
+        record(i, errors[i]);
+      }
+      for (auto &ev : early) {
+        confirm(&ev);
+      }
+    } else {
+      for (size_t i = 0; i < routes.size(); i++) {
+        auto &route = routes[i];
+        if (route.state != pending) {
+          continue;
+        }
+        if (set_client_name() != 0) {
+          route.state = failed;
+          continue;
+        }
+        set_subscription(subs, route);
+        record(i, subscribe_port(subs));
+
+        // keep the input buffer from overflowing on large profiles
+        wait_announcements(0, confirm);
+      }
+    }
+
+    subscribe_span.reset();
+
+    auto span = phase("confirm_wait");
+    if (!waiting.empty()) {
+      wait_announcements(timeout_ms, confirm);
+    }
+
+    // announcements can be dropped if the input buffer overflowed, so
+    // check anything still outstanding directly before giving up on it
+    for (auto [key, index] : waiting) {
+      auto &route = routes[index];
+      snd_seq_port_subscribe_set_sender(subs, &route.sender_addr);
+      snd_seq_port_subscribe_set_dest(subs, &route.dest_addr);
+      route.state =
+          backend->get_subscription(subs) == 0 ? confirmed : timed_out;
+    }
+  }
+
+  static void report_route(const Route &route) {
+    if (route.state == timed_out) {
+      std::cerr << "timed out: " << route.sender << " -> " << route.dest
+                << "\n";
+    } else if (route.state == failed) {
+      std::cerr << "failed: " << route.sender << " -> " << route.dest << "\n";
+    }
+  }
+
+  static uint32_t edge_key(const snd_seq_addr_t &sender,
+                           const snd_seq_addr_t &dest) {
+    return (uint32_t)sender.client << 24 | (uint32_t)sender.port << 16 |
+           (uint32_t)dest.client << 8 | dest.port;
+  }
+
+  /*
+   * a connection between two ports, for the graph analysis
+   */
+  struct Edge {
+    snd_seq_addr_t sender;
+    snd_seq_addr_t dest;
+  };
+
+  /*
+   * connections as adjacency lists, built in time linear in their number.
+   * ports are numbered in the order they first turn up, and port n sends
+   * to targets[offsets[n]] up to targets[offsets[n + 1]]
+   */
+  struct Graph {
+    std::vector<snd_seq_addr_t> ports;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> targets;
+    // by client << 8 | port, -1 for ports without connections
+    std::vector<int32_t> nodes = std::vector<int32_t>(1 << 16, -1);
+
+    explicit Graph(const std::vector<Edge> &edges) {
+      auto node = [&](const snd_seq_addr_t &addr) {
+        auto &n = nodes[addr.client << 8 | addr.port];
+        if (n < 0) {
+          n = ports.size();
+          ports.push_back(addr);
+        }
+        return (uint32_t)n;
+      };
+      std::vector<uint32_t> from(edges.size()), to(edges.size());
+      for (size_t i = 0; i < edges.size(); i++) {
+        from[i] = node(edges[i].sender);
+        to[i] = node(edges[i].dest);
+      }
+      // a counting sort by sender
+      offsets.assign(ports.size() + 1, 0);
+      for (auto n : from) {
+        offsets[n + 1]++;
+      }
+      for (size_t n = 0; n < ports.size(); n++) {
+        offsets[n + 1] += offsets[n];
+      }
+      std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+      targets.resize(edges.size());
+      for (size_t i = 0; i < edges.size(); i++) {
+        targets[next[from[i]]++] = to[i];
+      }
+    }
+
+    size_t size() const { return ports.size(); }
+  };
+
+  /*
+   * a loop through the ports of a strongly connected component, ending on
+   * the port it starts from, and how many ports the component has
+   */
+  struct Loop {
+    std::vector<uint32_t> path;
+    size_t ports;
+  };
+
+  /*
+   * the live connections, or with kept_only just those that restoring and
+   * reconciling leave in place
+   */
+  void live_edges(std::vector<Edge> &edges, bool kept_only) {
+    for (auto client : *get_clients()) {
+      for (auto port : *client->get_ports()) {
+        snd_seq_addr_t sender = {(unsigned char)port->get_client_id(),
+                                 (unsigned char)port->get_index()};
+        for (auto &conn : port->get_connections()) {
+          if (!kept_only || !is_removable(sender, conn)) {
+            edges.push_back({sender, {(unsigned char)conn.client_id_,
+                                      (unsigned char)conn.port_id_}});
+          }
+        }
+      }
+    }
+  }
+
+  /*
+   * the strongly connected component of every port, by Tarjan's algorithm
+   * with an explicit stack so long chains don't overflow the real one
+   */
+  static std::vector<uint32_t> find_components(const Graph &graph) {
+    const uint32_t unvisited = UINT32_MAX;
+    size_t size = graph.size();
+    std::vector<uint32_t> order(size, unvisited), low(size);
+    std::vector<uint32_t> component(size, unvisited);
+    std::vector<uint32_t> stack;
+    // the ports being visited and the next of their edges to follow
+    std::vector<std::pair<uint32_t, uint32_t>> calls;
+    uint32_t visited = 0, components = 0;
+    for (uint32_t root = 0; root < size; root++) {
+      if (order[root] != unvisited) {
+        continue;
+      }
+      order[root] = low[root] = visited++;
+      stack.push_back(root);
+      calls.push_back({root, graph.offsets[root]});
+      while (!calls.empty()) {
+        auto [node, edge] = calls.back();
+        if (edge < graph.offsets[node + 1]) {
+          calls.back().second++;
+          uint32_t target = graph.targets[edge];
+          if (order[target] == unvisited) {
+            order[target] = low[target] = visited++;
+            stack.push_back(target);
+            calls.push_back({target, graph.offsets[target]});
+          } else if (component[target] == unvisited) {
+            low[node] = std::min(low[node], order[target]);
+          }
+          continue;
+        }
+        if (low[node] == order[node]) {
+          uint32_t member;
+          do {
+            member = stack.back();
+            stack.pop_back();
+            component[member] = components;
+          } while (member != node);
+          components++;
+        }
+        calls.pop_back();
+        if (!calls.empty()) {
+          auto caller = calls.back().first;
+          low[caller] = std::min(low[caller], low[node]);
+        }
+      }
+    }
+    return component;
+  }
+
+  /*
+   * a loop for every component with more than one port or a port connected
+   * to itself. each is found by following connections that stay inside the
+   * component until a port comes round again, so every port and connection
+   * is looked at once
+   */
+  static std::vector<Loop> find_loops(const Graph &graph,
+                                      const std::vector<uint32_t> &component) {
+    size_t size = graph.size();
+    std::vector<size_t> members(size, 0);
+    std::vector<bool> looped(size, false);
+    for (uint32_t node = 0; node < size; node++) {
+      members[component[node]]++;
+      for (auto edge = graph.offsets[node]; edge < graph.offsets[node + 1];
+           edge++) {
+        if (graph.targets[edge] == node) {
+          looped[component[node]] = true;
+        }
+      }
+    }
+
+    std::vector<Loop> loops;
+    // one loop is reported per component
+    std::vector<bool> done(size, false);
+    // where a port is on the walk of its component, -1 until it is on one
+    std::vector<int32_t> position(size, -1);
+    std::vector<uint32_t> walk;
+    for (uint32_t start = 0; start < size; start++) {
+      auto c = component[start];
+      if ((members[c] < 2 && !looped[c]) || done[c]) {
+        continue;
+      }
+      walk.clear();
+      uint32_t node = start;
+      while (position[node] < 0) {
+        position[node] = walk.size();
+        walk.push_back(node);
+        // every port of a component this size has a connection inside it
+        auto edge = graph.offsets[node];
+        while (component[graph.targets[edge]] != c) {
+          edge++;
+        }
+        node = graph.targets[edge];
+      }
+      Loop loop{{walk.begin() + position[node], walk.end()}, members[c]};
+      loop.path.push_back(node);
+      loops.push_back(std::move(loop));
+      done[c] = true;
+    }
+    return loops;
+  }
+
+  // client:port by name, or by number for ports that have gone away
+  std::string port_label(const snd_seq_addr_t &addr) {
+    std::string_view client_name, port_name;
+    if (!find_names(addr.client, addr.port, client_name, port_name)) {
+      return fmt::format("{}:{}", addr.client, addr.port);
+    }
+    return fmt::format("{}:{}", client_name, port_name);
+  }
+
+  std::string describe_loop(const Graph &graph, const Loop &loop) {
+    std::string text;
+    for (auto node : loop.path) {
+      text += text.empty() ? "" : " -> ";
+      text += port_label(graph.ports[node]);
+    }
+    if (loop.ports > loop.path.size() - 1) {
+      text += fmt::format(" (one of the loops through {} ports)", loop.ports);
+    }
+    return text;
+  }
+
+  /*
+   * the ports with connections as Graphviz nodes grouped by client, and the
+   * connections that are part of a loop in red
+   */
+  void write_dot(const Graph &graph, const std::vector<Edge> &edges,
+                 const std::vector<uint32_t> &component,
+                 const std::vector<Loop> &loops) {
+    std::vector<bool> looped(graph.size(), false);
+    for (auto &loop : loops) {
+      looped[component[loop.path[0]]] = true;
+    }
+    out.append("digraph connections {\n  rankdir=LR;\n  node [shape=box];\n");
+    // in address order, so each client's ports come together
+    int open_client = -1;
+    for (uint32_t key = 0; key < graph.nodes.size(); key++) {
+      if (graph.nodes[key] < 0) {
+        continue;
+      }
+      int client = key >> 8;
+      std::string_view client_name, port_name;
+      bool named = find_names(client, key & 0xff, client_name, port_name);
+      if (client != open_client) {
+        out.append(open_client < 0 ? "" : "  }\n");
+        out.print("  subgraph \"cluster_{}\" {{\n    label=", client);
+        out.json_string(named ? client_name : fmt::format("{}", client));
+        out.append(";\n");
+        open_client = client;
+      }
+      out.print("    \"{}:{}\" [label=", client, key & 0xff);
+      out.json_string(named ? port_name : fmt::format("{}", key & 0xff));
+      out.append("];\n");
+    }
+    out.append(open_client < 0 ? "" : "  }\n");
+    for (auto &edge : edges) {
+      out.print("  \"{}:{}\" -> \"{}:{}\"", edge.sender.client,
+                edge.sender.port, edge.dest.client, edge.dest.port);
+      auto from = component[graph.nodes[edge.sender.client << 8 |
+                                        edge.sender.port]];
+      auto to =
+          component[graph.nodes[edge.dest.client << 8 | edge.dest.port]];
+      out.append(from == to && looped[from] ? " [color=red];\n" : ";\n");
+    }
+    out.append("}\n");
+    out.flush();
+  }
+
+  /*
+   * the ports along the shortest chain of connections from one port to
+   * another, both included, or nothing if there is none. only the ports
+   * on the way are asked for their subscribers
+   */
+  std::vector<snd_seq_addr_t> find_chain(const snd_seq_addr_t &from,
+                                         const snd_seq_addr_t &to) {
+    auto key = [](int client, int port) { return client << 8 | port; };
+    // by key, the port a port was reached from
+    std::vector<int32_t> reached_from(1 << 16, -1);
+    std::vector<int32_t> queue = {key(from.client, from.port)};
+    reached_from[queue[0]] = queue[0];
+    for (size_t i = 0; i < queue.size(); i++) {
+      auto at = queue[i];
+      if (at == key(to.client, to.port)) {
+        std::vector<snd_seq_addr_t> chain;
+        for (;; at = reached_from[at]) {
+          chain.push_back({(unsigned char)(at >> 8), (unsigned char)at});
+          if (at == queue[0]) {
+            break;
+          }
+        }
+        std::reverse(chain.begin(), chain.end());
+        return chain;
+      }
+      auto client = find_client(at >> 8);
+      auto port = client ? client->find_port(at & 0xff) : nullptr;
+      if (port == nullptr) {
+        continue;
+      }
+      for (auto &conn : port->get_connections()) {
+        auto next = key(conn.client_id_, conn.port_id_);
+        if (reached_from[next] < 0) {
+          reached_from[next] = at;
+          queue.push_back(next);
+        }
+      }
+    }
+    return {};
+  }
+
+  /*
+   * for --refuse-cycles, whether the routes together with the live
+   * connections would make a loop, leaving out the ones that restoring
+   * removes if replacing. the loops are reported
+   */
+  bool would_loop(const std::vector<Route> &routes, bool replacing) {
+    auto span = phase("analyze");
+    std::vector<Edge> edges;
+    live_edges(edges, replacing);
+    for (auto &route : routes) {
+      if (route.state != failed) {
+        edges.push_back({route.sender_addr, route.dest_addr});
+      }
+    }
+    Graph graph(edges);
+    auto loops = find_loops(graph, find_components(graph));
+    for (auto &loop : loops) {
+      std::cerr << "connections would loop: " << describe_loop(graph, loop)
+                << "\n";
+    }
+    return !loops.empty();
+  }
+
+  /*
+   * bring a single client up to date after a CLIENT_START or CLIENT_CHANGE
+   * announcement. a client the filter leaves out is not loaded
+   */
+  Client *update_client(int index) {
+    ClientInfo info;
+    if (backend->get_client(index, info) < 0 ||
+        !filter.accepts_client(info.type)) {
+      remove_client(index);
+      return nullptr;
+    }
+    std::string_view name = info.name;
+
+    auto it = clients_by_index.find(index);
+    if (it != clients_by_index.end()) {
+      auto client = it->second;
+      if (client->get_name() != name) {
+        unindex_name(client);
+        client->set_name(name);
+        clients_by_name.emplace(client->get_name(), client);
+        for_each_loaded_port(
+            [&](Port *p) { p->rename_connections(index, client->get_name()); });
+        invalidate_port_names();
+      }
+      return client;
+    }
+
+    auto client = client_pool.create(backend.get(), &names, this, &port_pool,
+                                     &filter, index, names.intern(name),
+                                     info.type);
+    clients_by_index.emplace(index, client);
+    if (clients_loaded) {
+      auto pos = std::lower_bound(
+          clients.begin(), clients.end(), index,
+          [](Client *c, int index) { return c->get_index() < index; });
+      clients.insert(pos, client);
+      clients_by_name.emplace(client->get_name(), client);
+    }
+    return client;
+  }
+
+  void remove_client(int index) {
+    auto it = clients_by_index.find(index);
+    if (it == clients_by_index.end()) {
+      return;
+    }
+    auto client = it->second;
+    unindex_name(client);
+    clients_by_index.erase(it);
+    auto pos = std::find(clients.begin(), clients.end(), client);
+    if (pos != clients.end()) {
+      clients.erase(pos);
+    }
+    invalidate_port_names();
+    client_pool.destroy(client);
+  }
+
+  /*
+   * look up a port only among the clients and ports already enumerated
+   */
+  Port *find_loaded_port(const snd_seq_addr_t &addr) {
+    auto it = clients_by_index.find(addr.client);
+    return it != clients_by_index.end()
+               ? it->second->find_loaded_port(addr.port)
+               : nullptr;
+  }
+
+  template <typename F> void for_each_loaded_port(F f) {
+    for (auto &entry : clients_by_index) {
+      for (auto port : *entry.second->get_loaded_ports()) {
+        f(port);
+      }
+    }
+  }
+
+  /*
+   * describe the destination of a subscription, from the loaded topology
+   * where possible
+   */
+  int make_connection(const snd_seq_addr_t &dest, Connection &conn) {
+    auto client = find_client(dest.client);
+    auto port = client ? client->find_port(dest.port) : nullptr;
+    if (port == nullptr) {
+      return -ENOENT;
+    }
+    conn = {dest.client, dest.port, client->get_name(), port->get_name()};
+    return 0;
+  }
+
+  /*
+   * drop a client from the name index, handing the name over to the next
+   * client that shares it
+   */
+  void unindex_name(Client *client) {
+    auto it = clients_by_name.find(client->get_name());
+    if (it == clients_by_name.end() || it->second != client) {
+      return;
+    }
+    clients_by_name.erase(it);
+    for (auto other : clients) {
+      if (other != client && other->get_name() == client->get_name()) {
+        clients_by_name.emplace(other->get_name(), other);
+        break;
+      }
+    }
+  }
+
+  /*
+   * the global port name index views names of ports that may be gone, so
+   * it is dropped whenever ports change and rebuilt on the next lookup
+   */
+  void invalidate_port_names() {
+    ports_by_name.clear();
+    ports_indexed = false;
+  }
+
+  /*
+   * subscribe a private port to System:Announce so that topology changes
+   * and subscription notifications can be waited for with poll()
+   */
+  int open_announce_port() {
+    if (announce_port >= 0) {
+      return 0;
+    }
+    int port = backend->open_announce_port();
+    if (port < 0) {
+      return port;
+    }
+    announce_port = port;
+    return 0;
+  }
 
-    assert(arg.length());
-
-    const std::regex addr_regex_full(
-        "[\'\"]?([^:\\.]+)?[\'\"]?[:\\.]?[\'\"]?([^:\\.]+)?[\'\"]?");
-    std::smatch addr_parts;
-
-    // match client and port
-    if (std::regex_match(arg, addr_parts, addr_regex_full)) {
-      arg_client_name = addr_parts[1].str();
-      arg_port_name = addr_parts[2].str();
-      // std::cout << "\ngot client: " << arg_client_name
-      //           << ", port: " << arg_port_name << "\n";
-
-      if (arg_client_name.length() != 0)
-      // client name or number was provided
-      {
-        // std::cout << "client name or number was provided\n";
-        // try to parse number from client string
-        auto cname_ptr = arg_client_name.data();
-        int parsed_client_id;
-
-        const auto client_iconv = std::from_chars(
-            cname_ptr, cname_ptr + arg_client_name.size(), parsed_client_id);
-
-        if (client_iconv.ec == std::errc()) {
-          // number was found
-          // std::cout << "parsed number " << parsed_client_id
-          // << " from client argument\n";
-          arg_client_id = parsed_client_id;
-          for (auto client_it : clients) {
-            if (arg_client_id == client_it->get_index()) {
-              // std::cout << "matched client id!\n";
-              client = client_it;
-              break;
-            }
-          }
-        } else {
-          // number not found, interpret as string
-          // std::cout
-          // << "client number not found, interpreting as string\n";
-          for (auto client_it : clients) {
-            if (arg_client_name == client_it->get_name()) {
-              // std::cout << "matched client name!\n";
-              client = client_it;
-              break;
-            }
-          }
-        }
+  /*
+   * pass incoming announcements to handler until it returns false or
+   * timeout_ms runs out. a timeout of 0 only drains what is already queued,
+   * a negative timeout waits forever. returns false on timeout
+   */
+  template <typename Handler>
+  bool wait_announcements(int timeout_ms, Handler handler) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
 
-        if (client == NULL) {
-          // client not found
-          std::cout << "invalid client entry\n";
-          return -ENOENT;
+    for (;;) {
+      snd_seq_event_t *ev;
+      int err;
+      while ((err = backend->event_input(&ev)) >= 0 || err == -ENOSPC) {
+        // -ENOSPC means events were lost to an overrun, keep reading
+        if (err >= 0 && !handler(ev)) {
+          return true;
         }
+      }
 
-        // try to parse number from port string
-        auto pname_ptr = arg_port_name.data();
-        int parsed_port_id;
-
-        const auto port_iconv = std::from_chars(
-            pname_ptr, pname_ptr + arg_port_name.size(), parsed_port_id);
-
-        if (arg_port_name.size() == 0) {
-          // port not provided
-          port = client->get_ports()->front();
-          addr->client = client->get_index();
-          addr->port = port->get_index();
-          return 0;
-        }
-
-        if (port_iconv.ec == std::errc() || arg_port_name.size() == 0) {
-          // number was found
-          // std::cout << "parsed number " << parsed_port_id
-          //           << " from port argument\n";
-          arg_port_id = parsed_port_id;
-          for (auto port : *client->get_ports()) {
-            if (arg_port_id == port->get_index()) {
-              // std::cout << "matched port id!\n";
-              addr->client = client->get_index();
-              addr->port = port->get_index();
-              return 0;
-            }
-          }
-        } else {
-          // number not found, interpret as string
-          // std::cout
-          //     << "port number not found, interpreting as string: "
-          //     << arg_port_name << "\n";
-          for (auto port : *client->get_ports()) {
-            if (arg_port_name == port->get_name()) {
-              // std::cout << "matched port name!\n";
-              addr->client = client->get_index();
-              addr->port = port->get_index();
-              return 0;
-            }
-          }
-        }
-      } else
-      // client name was not provided, search for port name in all clients
-      {
-        for (auto client_it : clients) {
-          for (auto port : *client_it->get_ports()) {
-            if (arg_port_name == port->get_name()) {
-              // std::cout << "matched port name!\n";
-              addr->client = client_it->get_index();
-              addr->port = port->get_index();
-              return 0;
-            }
-          }
-        }
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count();
+      if (timeout_ms < 0) {
+        remaining = -1;
+      } else if (remaining <= 0) {
+        return false;
+      }
+      if (backend->wait_input(remaining) < 0) {
+        return false;
       }
     }
-
-    return -ENOENT;
   }
 
-  inline static bool perm_ok(Port *p, unsigned int bits) {
-    return ((p->get_capability() & bits) == (bits));
+  // clients or ports ordered by name, the same names in the order given
+  template <typename T>
+  static std::vector<T *> by_name(const std::vector<T *> &items) {
+    std::vector<T *> sorted(items);
+    std::stable_sort(sorted.begin(), sorted.end(), [](T *a, T *b) {
+      return a->get_name() < b->get_name();
+    });
+    return sorted;
   }
 
-  static int check_permission(Port *p, unsigned int perm) {
-    if (perm) {
-      if (perm & LIST_INPUT) {
-        if (perm_ok(p, SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ))
-          goto __ok;
-      }
-      if (perm & LIST_OUTPUT) {
-        if (perm_ok(p, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
-          goto __ok;
-      }
-      return 0;
+  // whether text contains the characters of pattern in order, ignoring case
+  static bool is_subsequence(std::string_view pattern, std::string_view text) {
+    size_t matched = 0;
+    for (size_t i = 0; i < text.size() && matched < pattern.size(); i++) {
+      matched += tolower((unsigned char)text[i]) ==
+                 tolower((unsigned char)pattern[matched]);
     }
-  __ok:
-    if (p->get_capability() & SND_SEQ_PORT_CAP_NO_EXPORT)
-      return 0;
-    return 1;
+    return matched == pattern.size();
+  }
+
+  /*
+   * parse a whole string_view as a non-negative number
+   */
+  static bool parse_number(std::string_view str, int &value) {
+    const auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+    return res.ec == std::errc() && res.ptr == str.data() + str.size();
   }
 
   /*
@@ -574,47 +5627,388 @@ private:
     snd_seq_addr_t addr;
     addr.client = port->get_client_id();
     addr.port = port->get_index();
-    snd_seq_query_subscribe_t *subs;
-    snd_seq_query_subscribe_alloca(&subs);
-    snd_seq_query_subscribe_set_root(subs, &addr);
-    list_each_subs(subs, SND_SEQ_QUERY_SUBS_READ, "Connecting To");
-    list_each_subs(subs, SND_SEQ_QUERY_SUBS_WRITE, "Connected From");
+    list_each_subs(addr, SND_SEQ_QUERY_SUBS_READ, "Connecting To");
+    list_each_subs(addr, SND_SEQ_QUERY_SUBS_WRITE, "Connected From");
   }
 
   /*
    * list subscribers of specified type
    */
-  void list_each_subs(snd_seq_query_subscribe_t *subs,
+  void list_each_subs(const snd_seq_addr_t &root,
                       snd_seq_query_subs_type_t type, const char *msg) {
     int count = 0;
-    snd_seq_query_subscribe_set_type(subs, type);
-    snd_seq_query_subscribe_set_index(subs, 0);
-    while (snd_seq_query_port_subscribers(seq, subs) >= 0) {
-      const snd_seq_addr_t *addr;
+    SubscriberInfo sub;
+    while (backend->get_subscriber(root, type, count, sub) >= 0) {
       if (count++ == 0)
-        printf("\t%s: ", msg);
+        out.print("\t{}: ", msg);
       else
-        printf(", ");
-      addr = snd_seq_query_subscribe_get_addr(subs);
-      printf("%d:%d", addr->client, addr->port);
-      if (snd_seq_query_subscribe_get_exclusive(subs))
-        printf("[ex]");
-      if (snd_seq_query_subscribe_get_time_update(subs))
-        printf("[%s:%d]",
-               (snd_seq_query_subscribe_get_time_real(subs) ? "real" : "tick"),
-               snd_seq_query_subscribe_get_queue(subs));
-      snd_seq_query_subscribe_set_index(
-          subs, snd_seq_query_subscribe_get_index(subs) + 1);
+        out.append(", ");
+      out.print("{}:{}", sub.addr.client, sub.addr.port);
+      if (sub.exclusive)
+        out.append("[ex]");
+      if (sub.time_update)
+        out.print("[{}:{}]", (sub.time_real ? "real" : "tick"), sub.queue);
     }
     if (count > 0)
-      printf("\n");
+      out.append("\n");
+  }
+
+  /*
+   * what --monitor has counted for one sender since the last report. peak
+   * is the most events that arrived within one burst window
+   */
+  struct Traffic {
+    enum kind : int {
+      NOTE,
+      CONTROL,
+      PROGRAM,
+      CHANNEL_PRESSURE,
+      POLY_PRESSURE,
+      PITCH_BEND,
+      SYSEX,
+      REALTIME,
+      OTHER,
+      NUM_KINDS
+    };
+    static constexpr const char *kind_names[NUM_KINDS] = {
+        "note",          "control",    "program", "channel_pressure",
+        "poly_pressure", "pitch_bend", "sysex",   "realtime",
+        "other"};
+    static constexpr int64_t window_ms = 10;
+
+    snd_seq_addr_t addr;
+    std::string label;
+    uint64_t events = 0;
+    uint64_t kinds[NUM_KINDS] = {};
+    uint64_t sysex_bytes = 0;
+    int64_t window = -1;
+    uint32_t window_events = 0;
+    uint32_t peak = 0;
+
+    static kind kind_of(int type) {
+      switch (type) {
+      case SND_SEQ_EVENT_NOTE:
+      case SND_SEQ_EVENT_NOTEON:
+      case SND_SEQ_EVENT_NOTEOFF:
+        return NOTE;
+      case SND_SEQ_EVENT_CONTROLLER:
+      case SND_SEQ_EVENT_CONTROL14:
+      case SND_SEQ_EVENT_NONREGPARAM:
+      case SND_SEQ_EVENT_REGPARAM:
+        return CONTROL;
+      case SND_SEQ_EVENT_PGMCHANGE:
+        return PROGRAM;
+      case SND_SEQ_EVENT_CHANPRESS:
+        return CHANNEL_PRESSURE;
+      case SND_SEQ_EVENT_KEYPRESS:
+        return POLY_PRESSURE;
+      case SND_SEQ_EVENT_PITCHBEND:
+        return PITCH_BEND;
+      case SND_SEQ_EVENT_SYSEX:
+        return SYSEX;
+      case SND_SEQ_EVENT_SONGPOS:
+      case SND_SEQ_EVENT_SONGSEL:
+      case SND_SEQ_EVENT_QFRAME:
+      case SND_SEQ_EVENT_START:
+      case SND_SEQ_EVENT_CONTINUE:
+      case SND_SEQ_EVENT_STOP:
+      case SND_SEQ_EVENT_CLOCK:
+      case SND_SEQ_EVENT_TICK:
+      case SND_SEQ_EVENT_TUNE_REQUEST:
+      case SND_SEQ_EVENT_RESET:
+      case SND_SEQ_EVENT_SENSING:
+        return REALTIME;
+      default:
+        return OTHER;
+      }
+    }
+
+    void count(const snd_seq_event_t *ev) {
+      auto k = kind_of(ev->type);
+      events++;
+      kinds[k]++;
+      if (k == SYSEX) {
+        sysex_bytes += ev->data.ext.len;
+      }
+      auto &time = ev->time.time;
+      int64_t w = ((int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000) /
+                  window_ms;
+      if (w != window) {
+        window = w;
+        window_events = 0;
+      }
+      peak = std::max(peak, ++window_events);
+    }
+
+    // a burst window still open at the report starts over, so events
+    // already reported can't add to the next peak
+    void reset() {
+      events = sysex_bytes = peak = 0;
+      std::fill(std::begin(kinds), std::end(kinds), 0);
+      window = -1;
+      window_events = 0;
+    }
+  };
+
+  /*
+   * per second rates of every sender over the last elapsed seconds, as a
+   * table, redrawn in place on a terminal, or as a --watch style line of
+   * NDJSON per sender
+   */
+  void print_traffic(std::vector<Traffic> &senders, double elapsed,
+                     int overruns, output_format format, bool first,
+                     bool redraw) {
+    auto rate = [&](uint64_t n) { return (uint64_t)(n / elapsed + 0.5); };
+    auto peak_rate = [](const Traffic &t) {
+      return (uint64_t)t.peak * (1000 / Traffic::window_ms);
+    };
+    if (format == FORMAT_NDJSON) {
+      for (auto &t : senders) {
+        watch_stamp("traffic");
+        out.append(",\"sender\":");
+        watch_endpoint(t.addr);
+        out.print(",\"events_per_s\":{},\"peak_per_s\":{},"
+                  "\"sysex_bytes_per_s\":{},\"kinds\":{{",
+                  rate(t.events), peak_rate(t), rate(t.sysex_bytes));
+        for (int k = 0; k < Traffic::NUM_KINDS; k++) {
+          out.print("{}\"{}\":{}", k ? "," : "", Traffic::kind_names[k],
+                    rate(t.kinds[k]));
+        }
+        out.append("}}\n");
+        t.reset();
+      }
+      if (overruns > 0) {
+        watch_stamp("overrun");
+        out.print(",\"count\":{}}}\n", overruns);
+      }
+      out.flush();
+      return;
+    }
+
+    if (redraw) {
+      out.append("\x1b[H\x1b[2J");
+    } else if (!first) {
+      out.append("\n");
+    }
+    out.print("{:<24}{:>8}{:>8}{:>7}{:>7}{:>7}{:>7}{:>7}{:>7}{:>7}{:>7}{:>7}"
+              "{:>10}\n",
+              "sender", "ev/s", "peak/s", "note", "cc", "prog", "press",
+              "poly", "bend", "sysex", "rt", "other", "sysex B/s");
+    for (auto &t : senders) {
+      out.print("{:<23.23} {:>8}{:>8}", t.label, rate(t.events),
+                peak_rate(t));
+      for (auto n : t.kinds) {
+        out.print("{:>7}", rate(n));
+      }
+      out.print("{:>10}\n", rate(t.sysex_bytes));
+      t.reset();
+    }
+    if (overruns > 0) {
+      out.print("input overran {} times, events were lost\n", overruns);
+    }
+    out.flush();
+  }
+
+  // one "probe,latency_us" line per probe, with no latency if it was lost
+  static int write_probe_csv(const char *filename,
+                             const std::vector<int64_t> &latencies) {
+    std::ofstream file(filename);
+    if (!file) {
+      std::cerr << "can't write samples to '" << filename << "'\n";
+      return 1;
+    }
+    std::string text = "probe,latency_us\n";
+    for (size_t i = 0; i < latencies.size(); i++) {
+      if (latencies[i] < 0) {
+        text += fmt::format("{},\n", i);
+      } else {
+        text += fmt::format("{},{:.3f}\n", i, latencies[i] / 1000.0);
+      }
+    }
+    file << text;
+    return file.good() ? 0 : 1;
+  }
+
+  /*
+   * min, median, p99 and max of the probes that came back, jitter as the
+   * mean difference between consecutive ones, and a histogram with a
+   * bucket per power of two microseconds. returns 1 if any were lost
+   */
+  int print_probe_stats(const std::vector<int64_t> &latencies) {
+    std::vector<int64_t> sorted;
+    int64_t jitter = 0, previous = -1;
+    for (auto latency : latencies) {
+      if (latency < 0) {
+        continue;
+      }
+      if (previous >= 0) {
+        jitter += std::abs(latency - previous);
+      }
+      previous = latency;
+      sorted.push_back(latency);
+    }
+    size_t lost = latencies.size() - sorted.size();
+    out.print("{} probes, {} lost\n", latencies.size(), lost);
+    if (sorted.empty()) {
+      out.flush();
+      return 1;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    // nearest rank
+    auto percentile = [&](int p) {
+      size_t rank = (sorted.size() * p + 99) / 100;
+      return sorted[std::max<size_t>(rank, 1) - 1] / 1000.0;
+    };
+    out.print("min {:.1f} us, median {:.1f} us, p99 {:.1f} us, max {:.1f} us, "
+              "jitter {:.1f} us\n",
+              sorted.front() / 1000.0, percentile(50), percentile(99),
+              sorted.back() / 1000.0,
+              sorted.size() > 1 ? jitter / 1000.0 / (sorted.size() - 1) : 0.0);
+
+    // bucket 0 holds everything under 1 us, bucket b [2^(b-1), 2^b) us
+    std::vector<size_t> buckets;
+    for (auto latency : sorted) {
+      size_t bucket = 0;
+      for (auto us = latency / 1000; us > 0; us >>= 1) {
+        bucket++;
+      }
+      if (bucket >= buckets.size()) {
+        buckets.resize(bucket + 1);
+      }
+      buckets[bucket]++;
+    }
+    size_t most = *std::max_element(buckets.begin(), buckets.end());
+    size_t first = 0;
+    while (buckets[first] == 0) {
+      first++;
+    }
+    for (size_t b = first; b < buckets.size(); b++) {
+      auto low = b == 0 ? 0 : (int64_t)1 << (b - 1);
+      out.print("{:>16} {:>8} {}\n",
+                fmt::format("{}-{} us", low, (int64_t)1 << b), buckets[b],
+                std::string((buckets[b] * 40 + most - 1) / most, '#'));
+    }
+    out.flush();
+    return lost > 0 ? 1 : 0;
+  }
+
+  // the start of a --watch line, up to the event name
+  void watch_stamp(const char *event) {
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count();
+    out.print("{{\"monotonic_us\":{},\"event\":\"{}\"", now, event);
+  }
+
+  /*
+   * print an announcement and apply it to the topology, before printing
+   * if it adds or changes something and after if it takes something away,
+   * so the names are always those of the live port. changes to our own
+   * client are applied silently
+   */
+  void watch_event(const snd_seq_event_t *ev, int self) {
+    const snd_seq_addr_t &addr = ev->data.addr;
+    const snd_seq_connect_t &connect = ev->data.connect;
+    const char *event = nullptr;
+    bool removal = false;
+    switch (ev->type) {
+    case SND_SEQ_EVENT_CLIENT_START:
+      event = "client_start";
+      break;
+    case SND_SEQ_EVENT_CLIENT_CHANGE:
+      event = "client_change";
+      break;
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+      event = "client_exit";
+      removal = true;
+      break;
+    case SND_SEQ_EVENT_PORT_START:
+      event = "port_start";
+      break;
+    case SND_SEQ_EVENT_PORT_CHANGE:
+      event = "port_change";
+      break;
+    case SND_SEQ_EVENT_PORT_EXIT:
+      event = "port_exit";
+      removal = true;
+      break;
+    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+      event = "port_subscribed";
+      break;
+    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+      event = "port_unsubscribed";
+      removal = true;
+      break;
+    default:
+      return;
+    }
+    bool subscription = ev->type == SND_SEQ_EVENT_PORT_SUBSCRIBED ||
+                        ev->type == SND_SEQ_EVENT_PORT_UNSUBSCRIBED;
+    if (subscription ? connect.sender.client == self ||
+                           connect.dest.client == self
+                     : addr.client == self) {
+      update_topology(ev);
+      return;
+    }
+
+    if (!removal) {
+      update_topology(ev);
+    }
+    watch_stamp(event);
+    if (subscription) {
+      out.append(",\"sender\":");
+      watch_endpoint(connect.sender);
+      out.append(",\"dest\":");
+      watch_endpoint(connect.dest);
+    } else {
+      auto client = find_client(addr.client);
+      out.print(",\"client\":{},\"client_name\":", addr.client);
+      out.json_string(client ? client->get_name() : "");
+      if (ev->type >= SND_SEQ_EVENT_PORT_START) {
+        auto port = client ? client->find_port(addr.port) : nullptr;
+        out.print(",\"port\":{},\"port_name\":", addr.port);
+        out.json_string(port ? port->get_name() : "");
+        out.print(",\"capability\":{}", port ? port->get_capability() : 0);
+      } else if (client != nullptr) {
+        out.print(",\"client_type\":\"{}\"",
+                  client->get_type() == SND_SEQ_USER_CLIENT ? "user"
+                                                            : "kernel");
+      }
+    }
+    out.append("}\n");
+    if (removal) {
+      update_topology(ev);
+    }
+  }
+
+  // a port as {"client", "port", "client_name", "port_name"} for --watch
+  void watch_endpoint(const snd_seq_addr_t &addr) {
+    std::string_view client_name, port_name;
+    find_names(addr.client, addr.port, client_name, port_name);
+    bool first = true;
+    json_endpoint(first, addr.client, addr.port, client_name, port_name);
   }
 
   /*
    * search all ports
    */
   void print_port(Port *port) {
-    fmt::print("  {:<3} '{}'\n", port->get_index(), port->get_name());
+    out.print("  {:<3} '{}'\n", port->get_index(), port->get_name());
+  }
+
+  /*
+   * one end of a connection as a JSON object, preceded by a comma unless
+   * it is the first in its list
+   */
+  void json_endpoint(bool &first, int client_id, int port_id,
+                     std::string_view client_name, std::string_view port_name) {
+    out.print("{}{{\"client\":{},\"port\":{},\"client_name\":",
+              first ? "" : ",", client_id, port_id);
+    out.json_string(client_name);
+    out.append(",\"port_name\":");
+    out.json_string(port_name);
+    out.append("}");
+    first = false;
   }
 
   void print_port_and_subs(Port *port) {
@@ -626,6 +6020,18 @@ private:
     list_subscribers(port);
   }
 
+  /* set client info */
+  int set_client_name() {
+    if (!client_name_set) {
+      if (backend->set_client_name("ALSA Connector") < 0) {
+        std::cerr << "can't set client info\n";
+        return 1;
+      }
+      client_name_set = true;
+    }
+    return 0;
+  }
+
   int init_subscription(snd_seq_port_subscribe_t *subs,
                         const char *send_address, const char *dest_address,
                         int queue = 0, int exclusive = 0, int convert_time = 0,
@@ -633,17 +6039,16 @@ private:
     int client;
     snd_seq_addr_t sender, dest;
 
-    if ((client = snd_seq_client_id(seq)) < 0) {
+    if ((client = backend->client_id()) < 0) {
       std::cerr << "can't get client id\n";
       return 1;
     }
 
-    /* set client info */
-    if (snd_seq_set_client_name(seq, "ALSA Connector") < 0) {
-      std::cerr << "can't set client info\n";
+    if (set_client_name() != 0) {
       return 1;
     }
 
+    auto span = phase("resolve");
     if (parse_address(&sender, send_address) < 0) {
       std::cerr << "invalid sender address '" << send_address << "'\n";
       return 1;
@@ -665,6 +6070,10 @@ private:
   }
 };
 
+// other programs can build everything above without the command line
+// below, and bring a main() of their own
+#ifndef NEOACONNECT_NO_MAIN
+
 static void usage(void) {
   std::cout
       << "neoaconnect - ALSA sequencer connection manager\n"
@@ -678,32 +6087,220 @@ static void usage(void) {
          "     -e,--exclusive      exclusive connection\n"
          "     -r,--real #         convert real-time-stamp on queue\n"
          "     -t,--tick #         convert tick-time-stamp on queue\n"
+         " * Many connections/disconnections at once\n"
+         "   neoaconnect --batch FILE|- [--atomic]\n"
+         "     --batch FILE        apply one \"[-d] [-e] [-r|-t #] sender\n"
+         "                         receiver\" per line, - reads stdin\n"
+         "     --atomic            apply nothing if any line fails\n"
+         " * Connection/disconnection of every port matching a pattern\n"
+         "   neoaconnect --glob|--regex [-options] sender receiver\n"
+         "     --glob              sender and receiver are client:port globs\n"
+         "     --regex             ... or client:port regular expressions\n"
+         "     --pair=MODE         all (default), zip, all-to-one or\n"
+         "                         one-to-all\n"
+         "     --dry-run           only print the connections\n"
+         "     --atomic            apply nothing if any connection fails\n"
          " * List connected ports (no subscription action)\n"
          "   neoaconnect -i|-o [-options]\n"
          "     -i,--input          list input (readable ports)\n"
          "     -o,--output         list output (writable ports)\n"
+         "     --kernel, --user    list only kernel or user clients\n"
+         "     --exported          leave out ports that can't be routed\n"
+         "                         (implied by -i and -o)\n"
          "     -l,--list           list current connections of each port\n"
          "     -p,--ports          list only port names \n"
-         "                         (for shell completion scripts)"
+         "                         (for shell completion scripts)\n"
+         "     --format=FORMAT     with -l, -p or -s, print text (default),\n"
+         "                         json or ndjson (one object per line)\n"
+         "     --threads N         scan the clients and apply -S, -x and\n"
+         "                         profiles on N threads, each with its own\n"
+         "                         sequencer handle (default 1)\n"
+         " * Shell completion\n"
+         "     --complete PREFIX   print the addresses matching PREFIX\n"
+         "     --completion SHELL  print a completion script for fish, bash\n"
+         "                         or zsh\n"
          " * Remove all exported connections\n"
          "     -x,--removeall\n"
          " * Serialization of connections in TOML format\n"
          "    -s,--serialize      read current connections to terminal\n"
          "    -S FILENAME,\n"
-         "      --deserialize    repopulate connections from TOML file\n";
+         "      --deserialize    repopulate connections from TOML file\n"
+         "      --reconcile      with -S, only remove and add the connections\n"
+         "                       that differ from the file\n"
+         "      --timeout MS     wait up to MS milliseconds for restored\n"
+         "                       connections to be confirmed (default 1000)\n"
+         " * Named profiles kept in one binary file\n"
+         "      --save-profile NAME    store the current connections as NAME\n"
+         "      --load-profile NAME    restore NAME like -S (honours\n"
+         "                             --reconcile and --timeout)\n"
+         "      --import-profile NAME FILENAME\n"
+         "                             store a TOML file as NAME\n"
+         "      --export-profile NAME  print NAME as TOML\n"
+         "      --list-profiles        list the stored profiles\n"
+         "      --store FILE           the profile file (default\n"
+         "                             $XDG_DATA_HOME/neoaconnect-profiles)\n"
+         " * Keep the connections of a TOML file in place as devices come and go\n"
+         "      --daemon FILENAME\n"
+         "      --verify         check the tracked topology against a fresh\n"
+         "                       scan after every change\n"
+         " * Follow changes to clients, ports and connections\n"
+         "      --watch          print one NDJSON line per change as it\n"
+         "                       happens\n"
+         " * Measure the latency of a route\n"
+         "   neoaconnect --probe [sender receiver]\n"
+         "      --probe          send probes to receiver and time them back\n"
+         "                       from sender, or across the sequencer alone\n"
+         "                       without them\n"
+         "      --iterations N   send N probes (default 1000, at most 16384),\n"
+         "                       waiting up to --timeout MS for each\n"
+         "      --csv FILE       write every latency to FILE\n"
+         " * Count the events coming out of ports\n"
+         "   neoaconnect --monitor [--interval MS] [--format=ndjson] port...\n"
+         "      --monitor        print the events per second of each port by\n"
+         "                       kind, SysEx bytes and the peak burst rate\n"
+         "      --interval MS    how often to print them (default 1000)\n"
+         " * Look for loops in the connections\n"
+         "   neoaconnect --analyze [--format=dot] [FILENAME]\n"
+         "      --analyze        report loops, the ports with the most\n"
+         "                       connections out and in, and connections\n"
+         "                       listed twice, live or in a TOML file\n"
+         "      --format=dot     print the connections for Graphviz instead\n"
+         "      --refuse-cycles  refuse connections that would make a loop\n"
+         "                       when connecting, -S or --load-profile\n"
+         " * Diagnostics\n"
+         "      --stats          print the time spent in each phase and the\n"
+         "                       number of sequencer calls to stderr\n"
+         "      --trace=FILE     write the phases to FILE as Chrome trace\n"
+         "                       events\n"
+         " * Testing and timing without devices\n"
+         "      --synthetic C,P,E  use an in-memory sequencer with C clients of\n"
+         "                       P ports each, every port connected to E others\n";
 }
 
 /*
  * main..
  */
 
+/*
+ * shell completion scripts that ask --complete for the word being completed
+ */
+static int print_completion_script(const char *shell) {
+  if (strcmp(shell, "fish") == 0) {
+    std::cout << "complete -c neoaconnect -f -a "
+                 "'(neoaconnect --complete (commandline -ct) 2>/dev/null)'\n";
+  } else if (strcmp(shell, "bash") == 0) {
+    std::cout
+        << "_neoaconnect() {\n"
+           "  local cur=${COMP_WORDS[COMP_CWORD]} IFS=$'\\n'\n"
+           "  # ':' splits words in bash, complete the whole address\n"
+           "  if declare -F _get_comp_words_by_ref >/dev/null; then\n"
+           "    _get_comp_words_by_ref -n : cur\n"
+           "  fi\n"
+           "  COMPREPLY=($(neoaconnect --complete \"$cur\" 2>/dev/null |\n"
+           "    while read -r c; do printf '%q\\n' \"$c\"; done))\n"
+           "  if declare -F __ltrim_colon_completions >/dev/null; then\n"
+           "    __ltrim_colon_completions \"$cur\"\n"
+           "  fi\n"
+           "}\n"
+           "complete -F _neoaconnect neoaconnect\n";
+  } else if (strcmp(shell, "zsh") == 0) {
+    std::cout << "#compdef neoaconnect\n"
+                 "_neoaconnect() {\n"
+                 "  local -a addresses\n"
+                 "  addresses=(${(f)\"$(neoaconnect --complete \"$PREFIX\" "
+                 "2>/dev/null)\"})\n"
+                 "  compadd -U -- $addresses\n"
+                 "}\n"
+                 "compdef _neoaconnect neoaconnect\n";
+  } else {
+    std::cerr << "no completion script for '" << shell
+              << "', use fish, bash or zsh\n";
+    return 1;
+  }
+  return 0;
+}
+
+// where --save-profile and --load-profile keep their profiles unless
+// --store says otherwise
+static std::string default_store() {
+  const char *dir = getenv("XDG_DATA_HOME");
+  if (dir != nullptr && *dir) {
+    return fmt::format("{}/neoaconnect-profiles", dir);
+  }
+  const char *home = getenv("HOME");
+  return fmt::format("{}/.local/share/neoaconnect-profiles",
+                     home != nullptr ? home : ".");
+}
+
+// long options without a short equivalent
+enum long_only_option : int {
+  OPT_TIMEOUT = 256,
+  OPT_RECONCILE,
+  OPT_DAEMON,
+  OPT_VERIFY,
+  OPT_FORMAT,
+  OPT_THREADS,
+  OPT_SYNTHETIC,
+  OPT_STATS,
+  OPT_TRACE,
+  OPT_BATCH,
+  OPT_ATOMIC,
+  OPT_STORE,
+  OPT_SAVE_PROFILE,
+  OPT_LOAD_PROFILE,
+  OPT_IMPORT_PROFILE,
+  OPT_EXPORT_PROFILE,
+  OPT_LIST_PROFILES,
+  OPT_COMPLETE,
+  OPT_COMPLETION,
+  OPT_GLOB,
+  OPT_REGEX,
+  OPT_PAIR,
+  OPT_DRY_RUN,
+  OPT_KERNEL,
+  OPT_USER,
+  OPT_EXPORTED,
+  OPT_WATCH,
+  OPT_PROBE,
+  OPT_ITERATIONS,
+  OPT_CSV,
+  OPT_MONITOR,
+  OPT_INTERVAL,
+  OPT_ANALYZE,
+  OPT_REFUSE_CYCLES
+};
+
 static const struct option long_option[] = {
     {"disconnect", 0, NULL, 'd'},  {"input", 0, NULL, 'i'},
     {"output", 0, NULL, 'o'},      {"real", 1, NULL, 'r'},
     {"tick", 1, NULL, 't'},        {"exclusive", 0, NULL, 'e'},
     {"list", 0, NULL, 'l'},        {"ports", 0, NULL, 'p'},
     {"removeall", 0, NULL, 'x'},   {"serialize", 0, NULL, 's'},
-    {"deserialize", 0, NULL, 'S'}, {NULL, 0, NULL, 0},
+    {"deserialize", 0, NULL, 'S'}, {"timeout", 1, NULL, OPT_TIMEOUT},
+    {"reconcile", 0, NULL, OPT_RECONCILE}, {"daemon", 1, NULL, OPT_DAEMON},
+    {"verify", 0, NULL, OPT_VERIFY},       {"format", 1, NULL, OPT_FORMAT},
+    {"threads", 1, NULL, OPT_THREADS},     {"synthetic", 1, NULL, OPT_SYNTHETIC},
+    {"stats", 0, NULL, OPT_STATS},         {"trace", 1, NULL, OPT_TRACE},
+    {"batch", 1, NULL, OPT_BATCH},         {"atomic", 0, NULL, OPT_ATOMIC},
+    {"store", 1, NULL, OPT_STORE},
+    {"save-profile", 1, NULL, OPT_SAVE_PROFILE},
+    {"load-profile", 1, NULL, OPT_LOAD_PROFILE},
+    {"import-profile", 1, NULL, OPT_IMPORT_PROFILE},
+    {"export-profile", 1, NULL, OPT_EXPORT_PROFILE},
+    {"list-profiles", 0, NULL, OPT_LIST_PROFILES},
+    {"complete", 1, NULL, OPT_COMPLETE},
+    {"completion", 1, NULL, OPT_COMPLETION},
+    {"glob", 0, NULL, OPT_GLOB},           {"regex", 0, NULL, OPT_REGEX},
+    {"pair", 1, NULL, OPT_PAIR},           {"dry-run", 0, NULL, OPT_DRY_RUN},
+    {"kernel", 0, NULL, OPT_KERNEL},       {"user", 0, NULL, OPT_USER},
+    {"exported", 0, NULL, OPT_EXPORTED},
+    {"watch", 0, NULL, OPT_WATCH},         {"probe", 0, NULL, OPT_PROBE},
+    {"iterations", 1, NULL, OPT_ITERATIONS},
+    {"csv", 1, NULL, OPT_CSV},
+    {"monitor", 0, NULL, OPT_MONITOR},     {"interval", 1, NULL, OPT_INTERVAL},
+    {"analyze", 0, NULL, OPT_ANALYZE},
+    {"refuse-cycles", 0, NULL, OPT_REFUSE_CYCLES},
+    {NULL, 0, NULL, 0},
 };
 
 int main(int argc, char **argv) {
@@ -714,15 +6311,48 @@ int main(int argc, char **argv) {
     ports,
     remove_all,
     serialize,
-    deserialize
+    deserialize,
+    daemon_mode,
+    batch,
+    save_profile,
+    load_profile,
+    import_profile,
+    export_profile,
+    list_profiles,
+    complete,
+    watch,
+    probe,
+    monitor,
+    analyze
   };
 
-  std::unique_ptr<Seq> seq = std::make_unique<Seq>();
   int c;
   int command = subscribe;
-  int list_perm = 0;
+  PortFilter filter;
   int list_subs = 0;
   int queue = 0, convert_time = 0, convert_real = 0, exclusive = 0;
+  int timeout = 1000;
+  bool reconcile = false;
+  char *profile = nullptr;
+  bool verify = false;
+  auto format = Seq::FORMAT_TEXT;
+  bool format_given = false;
+  int threads = 1;
+  bool synthetic = false;
+  int synthetic_clients = 0, synthetic_ports = 0, synthetic_edges = 0;
+  bool stats = false;
+  char *trace_file = nullptr;
+  char *batch_file = nullptr;
+  bool atomic = false;
+  std::string store = default_store();
+  char *profile_name = nullptr;
+  char *complete_prefix = nullptr;
+  bool glob = false, regex = false, dry_run = false;
+  auto pair = Seq::PAIR_ALL;
+  int iterations = 0;
+  char *csv_file = nullptr;
+  int interval = 0;
+  bool refuse_cycles = false;
 
   // CHANGE TO CLASS METHODS
   while ((c = getopt_long(argc, argv, "dior:t:elpsSx", long_option, NULL)) !=
@@ -759,58 +6389,409 @@ int main(int argc, char **argv) {
       list_subs = 1;
       break;
     case 'i':
-      // command = commands::list;
-      list_perm |= Seq::LIST_INPUT;
+      filter.input = true;
+      filter.exported = true;
       break;
     case 'o':
-      // command = commands::list;
-      list_perm |= Seq::LIST_OUTPUT;
+      filter.output = true;
+      filter.exported = true;
+      break;
+    case OPT_KERNEL:
+      filter.client_type = SND_SEQ_KERNEL_CLIENT;
+      break;
+    case OPT_USER:
+      filter.client_type = SND_SEQ_USER_CLIENT;
+      break;
+    case OPT_EXPORTED:
+      filter.exported = true;
+      break;
+    case OPT_WATCH:
+      command = commands::watch;
+      break;
+    case OPT_PROBE:
+      command = commands::probe;
+      break;
+    case OPT_ITERATIONS:
+      iterations = atoi(optarg);
+      if (iterations < 1 || iterations > Seq::max_probes) {
+        std::cerr << "invalid iteration count '" << optarg << "'\n";
+        exit(1);
+      }
+      break;
+    case OPT_CSV:
+      csv_file = optarg;
+      break;
+    case OPT_MONITOR:
+      command = commands::monitor;
+      break;
+    case OPT_INTERVAL:
+      interval = atoi(optarg);
+      if (interval < 1) {
+        std::cerr << "invalid interval '" << optarg << "'\n";
+        exit(1);
+      }
+      break;
+    case OPT_ANALYZE:
+      command = commands::analyze;
+      break;
+    case OPT_REFUSE_CYCLES:
+      refuse_cycles = true;
       break;
     case 'x':
       command = commands::remove_all;
       break;
+    case OPT_TIMEOUT:
+      timeout = atoi(optarg);
+      break;
+    case OPT_RECONCILE:
+      reconcile = true;
+      break;
+    case OPT_DAEMON:
+      command = commands::daemon_mode;
+      profile = optarg;
+      break;
+    case OPT_VERIFY:
+      verify = true;
+      break;
+    case OPT_FORMAT:
+      if (strcmp(optarg, "text") == 0) {
+        format = Seq::FORMAT_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        format = Seq::FORMAT_JSON;
+      } else if (strcmp(optarg, "ndjson") == 0) {
+        format = Seq::FORMAT_NDJSON;
+      } else if (strcmp(optarg, "dot") == 0) {
+        format = Seq::FORMAT_DOT;
+      } else {
+        std::cerr << "unknown format '" << optarg << "'\n";
+        exit(1);
+      }
+      format_given = true;
+      break;
+    case OPT_SYNTHETIC:
+      if (sscanf(optarg, "%d,%d,%d", &synthetic_clients, &synthetic_ports,
+                 &synthetic_edges) != 3 ||
+          synthetic_clients < 0 ||
+          synthetic_clients > MemoryBackend::max_clients ||
+          synthetic_ports < 0 || synthetic_ports > MemoryBackend::max_ports ||
+          synthetic_edges < 0) {
+        std::cerr << "invalid synthetic topology '" << optarg
+                  << "', expected CLIENTS,PORTS,EDGES with at most "
+                  << MemoryBackend::max_clients << " clients of "
+                  << MemoryBackend::max_ports << " ports\n";
+        exit(1);
+      }
+      synthetic = true;
+      break;
+    case OPT_BATCH:
+      command = commands::batch;
+      batch_file = optarg;
+      break;
+    case OPT_ATOMIC:
+      atomic = true;
+      break;
+    case OPT_STORE:
+      store = optarg;
+      break;
+    case OPT_SAVE_PROFILE:
+      command = commands::save_profile;
+      profile_name = optarg;
+      break;
+    case OPT_LOAD_PROFILE:
+      command = commands::load_profile;
+      profile_name = optarg;
+      break;
+    case OPT_IMPORT_PROFILE:
+      command = commands::import_profile;
+      profile_name = optarg;
+      break;
+    case OPT_EXPORT_PROFILE:
+      command = commands::export_profile;
+      profile_name = optarg;
+      break;
+    case OPT_LIST_PROFILES:
+      command = commands::list_profiles;
+      break;
+    case OPT_COMPLETE:
+      command = commands::complete;
+      complete_prefix = optarg;
+      break;
+    case OPT_GLOB:
+      glob = true;
+      break;
+    case OPT_REGEX:
+      regex = true;
+      break;
+    case OPT_PAIR:
+      if (strcmp(optarg, "all") == 0) {
+        pair = Seq::PAIR_ALL;
+      } else if (strcmp(optarg, "zip") == 0) {
+        pair = Seq::PAIR_ZIP;
+      } else if (strcmp(optarg, "all-to-one") == 0) {
+        pair = Seq::PAIR_ALL_TO_ONE;
+      } else if (strcmp(optarg, "one-to-all") == 0) {
+        pair = Seq::PAIR_ONE_TO_ALL;
+      } else {
+        std::cerr << "unknown pairing '" << optarg << "'\n";
+        exit(1);
+      }
+      glob = glob || !regex;
+      break;
+    case OPT_DRY_RUN:
+      dry_run = true;
+      break;
+    case OPT_COMPLETION:
+      // the scripts don't need the sequencer
+      exit(print_completion_script(optarg));
+    case OPT_STATS:
+      stats = true;
+      break;
+    case OPT_TRACE:
+      trace_file = optarg;
+      break;
+    case OPT_THREADS:
+      threads = atoi(optarg);
+      if (threads < 1) {
+        std::cerr << "invalid thread count '" << optarg << "'\n";
+        exit(1);
+      }
+      break;
     default:
       usage();
       exit(1);
     }
   }
 
+  if (format_given && command != commands::list && command != commands::ports &&
+      command != commands::serialize && command != commands::monitor &&
+      command != commands::analyze) {
+    std::cerr << "--format only applies to -l, -p, -s, --monitor and "
+                 "--analyze\n";
+    exit(1);
+  }
+  if (command == commands::monitor && format == Seq::FORMAT_JSON) {
+    std::cerr << "--monitor prints text or ndjson\n";
+    exit(1);
+  }
+  if (command == commands::analyze && format != Seq::FORMAT_TEXT &&
+      format != Seq::FORMAT_DOT) {
+    std::cerr << "--analyze prints text or dot\n";
+    exit(1);
+  }
+  if (command != commands::analyze && format == Seq::FORMAT_DOT) {
+    std::cerr << "--format=dot only applies to --analyze\n";
+    exit(1);
+  }
+
+  // like aconnect, -i or -o on their own list the ports
+  if (filter.active() && command == commands::subscribe && optind == argc) {
+    command = commands::list;
+  }
+  if (filter.active() && command != commands::list &&
+      command != commands::ports) {
+    std::cerr << "-i, -o, --kernel, --user and --exported only apply to "
+                 "listing\n";
+    exit(1);
+  }
+
+  bool patterns = glob || regex;
+  if (patterns && command != commands::subscribe &&
+      command != commands::unsubscribe) {
+    std::cerr << "--glob, --regex and --pair only apply to connecting and "
+                 "disconnecting\n";
+    exit(1);
+  }
+
+  if (dry_run && !patterns) {
+    std::cerr << "--dry-run only applies to --glob and --regex\n";
+    exit(1);
+  }
+
+  if (atomic && command != commands::batch && !patterns) {
+    std::cerr << "--atomic only applies to --batch, --glob and --regex\n";
+    exit(1);
+  }
+
+  if ((command == commands::deserialize ||
+       command == commands::import_profile) &&
+      optind + 1 > argc) {
+    usage();
+    exit(1);
+  }
+
+  if ((command == commands::subscribe || command == commands::unsubscribe) &&
+      optind + 2 > argc) {
+    usage();
+    exit(1);
+  }
+
+  // either both ends of the loop or neither
+  if (command == commands::probe && optind != argc && optind + 2 != argc) {
+    usage();
+    exit(1);
+  }
+  if (command != commands::probe && (iterations > 0 || csv_file != nullptr)) {
+    std::cerr << "--iterations and --csv only apply to --probe\n";
+    exit(1);
+  }
+
+  if (command == commands::monitor && optind == argc) {
+    usage();
+    exit(1);
+  }
+  if (command != commands::monitor && interval > 0) {
+    std::cerr << "--interval only applies to --monitor\n";
+    exit(1);
+  }
+
+  if (command == commands::analyze && optind + 1 < argc) {
+    usage();
+    exit(1);
+  }
+  if (refuse_cycles &&
+      ((command != commands::subscribe && command != commands::deserialize &&
+        command != commands::load_profile) ||
+       patterns)) {
+    std::cerr << "--refuse-cycles only applies to connecting, -S and "
+                 "--load-profile\n";
+    exit(1);
+  }
+
+  std::unique_ptr<Trace> trace;
+  if (stats || trace_file != nullptr) {
+    trace = std::make_unique<Trace>();
+  }
+
+  // the sequencer is only opened once the command line has been validated
+  std::unique_ptr<Backend> backend;
+  {
+    Trace::Scope span(trace.get(), "open");
+    if (synthetic) {
+      backend = std::make_unique<MemoryBackend>(
+          synthetic_clients, synthetic_ports, synthetic_edges);
+    } else {
+      backend = std::make_unique<AlsaBackend>();
+    }
+  }
+  if (trace != nullptr) {
+    backend = std::make_unique<CountingBackend>(std::move(backend), trace.get());
+  }
+  auto seq = std::make_unique<Seq>(std::move(backend), trace.get());
+  seq->set_filter(filter);
+  seq->set_threads(threads);
+  seq->set_refuse_cycles(refuse_cycles);
+
+  // load everything the command is going to look at up front
+  if (threads > 1) {
+    switch (command) {
+    case commands::list:
+      seq->scan(threads, list_subs);
+      break;
+    case commands::serialize:
+    case commands::save_profile:
+      seq->scan(threads, true);
+      break;
+    case commands::ports:
+    case commands::watch:
+      seq->scan(threads, false);
+      break;
+    case commands::remove_all:
+    case commands::deserialize:
+    case commands::load_profile:
+      // what is removed is taken from the connections scanned here
+      seq->scan(threads, true);
+      break;
+    case commands::analyze:
+      seq->scan(threads, optind == argc);
+      break;
+    }
+  }
+
+  int result = 0;
   switch (command) {
   case commands::list:
-    seq->print_list(list_perm, list_subs);
-    return 0;
+    seq->print_list(list_subs, format);
+    break;
   case commands::ports:
-    seq->print_all_ports(list_perm, list_subs);
-    return 0;
+    seq->print_all_ports(format);
+    break;
   case commands::remove_all:
     seq->remove_all_connections();
-    return 0;
+    break;
   case commands::serialize:
-    seq->serialize_connections();
-    return 0;
+    seq->serialize_connections(format);
+    break;
   case commands::deserialize:
-    if (optind + 1 > argc) {
-      usage();
-      exit(1);
+    if (reconcile) {
+      result = seq->reconcile_connections(argv[optind], timeout);
+    } else {
+      result = seq->deserialize_connections(argv[optind], true, timeout);
     }
-    seq->deserialize_connections(argv[optind]);
-    return 0;
-  }
-
+    break;
+  case commands::daemon_mode:
+    result = seq->run_daemon(profile, timeout, verify);
+    break;
+  case commands::batch:
+    result = seq->apply_batch(batch_file, atomic);
+    break;
+  case commands::save_profile:
+    result = seq->save_profile(store.c_str(), profile_name);
+    break;
+  case commands::load_profile:
+    result = seq->load_profile(store.c_str(), profile_name, reconcile, timeout);
+    break;
+  case commands::import_profile:
+    result = seq->import_profile(store.c_str(), profile_name, argv[optind]);
+    break;
+  case commands::export_profile:
+    result = seq->export_profile(store.c_str(), profile_name);
+    break;
+  case commands::list_profiles:
+    result = seq->list_profiles(store.c_str());
+    break;
+  case commands::complete:
+    seq->complete(complete_prefix);
+    break;
+  case commands::watch:
+    result = seq->watch();
+    break;
+  case commands::probe:
+    result = seq->probe(optind < argc ? argv[optind] : nullptr,
+                        optind < argc ? argv[optind + 1] : nullptr,
+                        iterations > 0 ? iterations : 1000, timeout, csv_file);
+    break;
+  case commands::monitor:
+    result = seq->monitor(argv + optind, argc - optind,
+                          interval > 0 ? interval : 1000, format);
+    break;
+  case commands::analyze:
+    result = seq->analyze(optind < argc ? argv[optind] : nullptr, format);
+    break;
   /* connection or disconnection */
-
-  if (optind + 2 > argc) {
-    usage();
-    exit(1);
+  case commands::unsubscribe:
+  case commands::subscribe:
+    if (patterns) {
+      result = seq->fan_out(argv[optind], argv[optind + 1],
+                            command == commands::unsubscribe, regex, pair,
+                            dry_run, atomic, queue, exclusive, convert_time,
+                            convert_real);
+    } else if (command == commands::unsubscribe) {
+      result = seq->unsubscribe(argv[optind], argv[optind + 1], queue,
+                                exclusive, convert_time, convert_real);
+    } else {
+      result = seq->subscribe(argv[optind], argv[optind + 1], queue, exclusive,
+                              convert_time, convert_real);
+    }
+    break;
   }
 
-  if (command == commands::unsubscribe) {
-    seq->unsubscribe(argv[optind], argv[optind + 1], queue, exclusive,
-                     convert_time, convert_real);
-  } else {
-    seq->subscribe(argv[optind], argv[optind + 1], queue, exclusive,
-                   convert_time, convert_real);
+  if (stats) {
+    trace->print_stats();
   }
-
-  return 0;
+  if (trace_file != nullptr && trace->write_chrome_trace(trace_file) != 0) {
+    result = 1;
+  }
+  return result;
 }
+
+#endif // NEOACONNECT_NO_MAIN
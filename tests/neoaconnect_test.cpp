@@ -0,0 +1,694 @@
+/*
+ * neoaconnect_test - checks of neoaconnect against the in-memory sequencer
+ *
+ *   neoaconnect_test [--list] [CASE...]
+ *
+ * runs every case, or only those named, and exits with 1 if any check
+ * failed. ctest runs each case on its own
+ */
+
+#define NEOACONNECT_NO_MAIN
+#include "../neoaconnect.cpp"
+
+#include <functional>
+#include <sstream>
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(cond) expect((cond), #cond, __LINE__)
+
+void expect(bool ok, const char *what, int line) {
+  if (!ok) {
+    fmt::print(stderr, "line {}: expected {}\n", line, what);
+    failures++;
+  }
+}
+
+/*
+ * a file under /tmp that is removed again when it goes out of scope
+ */
+class TempFile {
+public:
+  TempFile(std::string_view content = {}) {
+    int fd = mkstemp(path_.data());
+    if (fd < 0) {
+      perror("temporary file");
+      exit(1);
+    }
+    close(fd);
+    write(content);
+  }
+
+  ~TempFile() { unlink(path_.c_str()); }
+
+  char *path() { return path_.data(); }
+
+  void write(std::string_view content) {
+    std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+    file.write(content.data(), content.size());
+  }
+
+  std::string read() {
+    std::ifstream file(path_, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file),
+            std::istreambuf_iterator<char>()};
+  }
+
+private:
+  std::string path_ = "/tmp/neoaconnect_testXXXXXX";
+};
+
+/*
+ * everything run() writes to stdout, or to stderr. Seq writes straight to
+ * the file descriptor, so it is swapped for a file while run() goes on
+ */
+std::string capture(const std::function<void()> &run,
+                    int target = STDOUT_FILENO) {
+  TempFile file;
+  fflush(stdout);
+  std::cerr.flush();
+  int saved = dup(target);
+  int fd = open(file.path(), O_WRONLY | O_TRUNC);
+  dup2(fd, target);
+  close(fd);
+  run();
+  fflush(stdout);
+  std::cerr.flush();
+  dup2(saved, target);
+  close(saved);
+  return file.read();
+}
+
+// a Seq on a handle of its own, with its calls counted in trace if given
+std::unique_ptr<Seq> open_seq(MemoryBackend &world, Trace *trace = nullptr) {
+  auto backend = world.open_another();
+  if (trace != nullptr) {
+    backend = std::make_unique<CountingBackend>(std::move(backend), trace);
+  }
+  return std::make_unique<Seq>(std::move(backend), trace);
+}
+
+std::string serialize(MemoryBackend &world) {
+  return capture([&] { open_seq(world)->serialize_connections(); });
+}
+
+/*
+ * a world of four clients with two ports each and a few connections
+ * between them, all made through Seq
+ */
+std::unique_ptr<MemoryBackend> small_world() {
+  auto world = std::make_unique<MemoryBackend>(4, 2, 0);
+  auto seq = open_seq(*world);
+  seq->subscribe("16:0", "17:0");
+  seq->subscribe("16:1", "18:0");
+  seq->subscribe("17:1", "19:1");
+  return world;
+}
+
+/*
+ * restoring the connections that are already there changes nothing
+ */
+void test_reconcile_unchanged() {
+  auto world = small_world();
+  TempFile profile(serialize(*world));
+  Trace trace;
+  EXPECT(open_seq(*world, &trace)->reconcile_connections(profile.path()) == 0);
+  EXPECT(trace.calls(Trace::SUBSCRIBE_PORT) == 0);
+  EXPECT(trace.calls(Trace::UNSUBSCRIBE_PORT) == 0);
+}
+
+/*
+ * only the connection that went away is made again, and only the one that
+ * was added is removed
+ */
+void test_reconcile_difference() {
+  auto world = small_world();
+  auto before = serialize(*world);
+  TempFile profile(before);
+  {
+    auto seq = open_seq(*world);
+    EXPECT(seq->unsubscribe((char *)"16:0", (char *)"17:0") == 0);
+    EXPECT(seq->subscribe("18:1", "19:0") == 0);
+  }
+  Trace trace;
+  EXPECT(open_seq(*world, &trace)->reconcile_connections(profile.path()) == 0);
+  EXPECT(trace.calls(Trace::SUBSCRIBE_PORT) == 1);
+  EXPECT(trace.calls(Trace::UNSUBSCRIBE_PORT) == 1);
+  EXPECT(serialize(*world) == before);
+
+  Trace again;
+  EXPECT(open_seq(*world, &again)->reconcile_connections(profile.path()) == 0);
+  EXPECT(again.calls(Trace::SUBSCRIBE_PORT) == 0);
+  EXPECT(again.calls(Trace::UNSUBSCRIBE_PORT) == 0);
+}
+
+/*
+ * an exclusive connection is refused where its sender or destination
+ * already has connections, and keeps any other connection from being made
+ * from its sender or to its destination until it is gone
+ */
+void test_exclusive_subscribe() {
+  MemoryBackend world(4, 2, 0);
+  auto seq = open_seq(world);
+  EXPECT(seq->subscribe("16:0", "17:0", 0, 1) == 0);
+  EXPECT(seq->subscribe("18:0", "17:0") != 0);
+  EXPECT(seq->subscribe("16:0", "18:1") != 0);
+  EXPECT(seq->subscribe("16:1", "18:0") == 0);
+  EXPECT(seq->subscribe("16:1", "19:0", 0, 1) != 0);
+  EXPECT(seq->subscribe("19:1", "18:0", 0, 1) != 0);
+  EXPECT(seq->unsubscribe((char *)"16:0", (char *)"17:0") == 0);
+  EXPECT(seq->subscribe("18:0", "17:0") == 0);
+  EXPECT(seq->subscribe("16:0", "18:1") == 0);
+}
+
+/*
+ * with --atomic, a line that fails to apply undoes the lines before it,
+ * bringing back what they disconnected with its old flags
+ */
+void test_batch_atomic_rollback() {
+  auto world = small_world();
+  EXPECT(open_seq(*world)->subscribe("19:0", "18:1", 0, 1) == 0);
+  auto before = serialize(*world);
+  TempFile batch("-d 19:0 18:1\n"
+                 "-d 16:0 17:0\n"
+                 "18:0 19:0\n"
+                 "# already connected\n"
+                 "17:1 19:1\n"
+                 "16:0 19:0\n");
+  EXPECT(open_seq(*world)->apply_batch(batch.path(), true) != 0);
+  EXPECT(serialize(*world) == before);
+}
+
+/*
+ * with --atomic, nothing at all is applied if a line does not resolve
+ */
+void test_batch_atomic_unresolved() {
+  auto world = small_world();
+  auto before = serialize(*world);
+  TempFile batch("-d 16:0 17:0\n"
+                 "18:0 19:0\n"
+                 "16:0 'No Such Client':0\n");
+  Trace trace;
+  EXPECT(open_seq(*world, &trace)->apply_batch(batch.path(), true) != 0);
+  EXPECT(trace.calls(Trace::SUBSCRIBE_PORT) == 0);
+  EXPECT(trace.calls(Trace::UNSUBSCRIBE_PORT) == 0);
+  EXPECT(serialize(*world) == before);
+}
+
+/*
+ * the table headers and port keys of a TOML profile, in order
+ */
+std::vector<std::string> outline(const std::string &text) {
+  std::vector<std::string> heads;
+  std::istringstream lines(text);
+  for (std::string line; std::getline(lines, line);) {
+    if (!line.empty()) {
+      heads.push_back(line[0] == '[' ? line : line.substr(0, line.find(" = ")));
+    }
+  }
+  return heads;
+}
+
+/*
+ * -s lists clients and their ports by name, as --export-profile does, so
+ * exporting what -s printed gives the tables and keys in the same order.
+ * "Synth 10" comes before "Synth 2" by name but not by number
+ */
+void test_serialize_sorted() {
+  MemoryBackend world(12, 12, 2);
+  auto text = serialize(world);
+  auto heads = outline(text);
+  std::vector<std::string> tables, keys;
+  for (auto &head : heads) {
+    if (head[0] == '[') {
+      tables.push_back(head);
+      EXPECT(std::is_sorted(keys.begin(), keys.end()));
+      keys.clear();
+    } else {
+      keys.push_back(head);
+    }
+  }
+  EXPECT(tables.size() == 12);
+  EXPECT(std::is_sorted(tables.begin(), tables.end()));
+  EXPECT(std::is_sorted(keys.begin(), keys.end()));
+
+  TempFile profile(text), store;
+  // the store is created by the first import
+  unlink(store.path());
+  auto seq = open_seq(world);
+  capture([&] {
+    EXPECT(seq->import_profile(store.path(), "sorted", profile.path()) == 0);
+  });
+  EXPECT(outline(capture([&] {
+           seq->export_profile(store.path(), "sorted");
+         })) == heads);
+}
+
+/*
+ * a connection listed twice is stored once, and counted once
+ */
+void test_profile_counts() {
+  MemoryBackend world(2, 2, 0);
+  TempFile profile("[\"Synth 0\"]\n"
+                   "\"Synth 0 Port 0\" = [ \"Synth 1:Synth 1 Port 0\", "
+                   "\"Synth 1:Synth 1 Port 0\" ]\n"
+                   "\"Synth 0 Port 1\" = [ \"Synth 1:Synth 1 Port 1\" ]\n"),
+      store;
+  unlink(store.path());
+  auto seq = open_seq(world);
+  EXPECT(capture([&] {
+           seq->import_profile(store.path(), "twice", profile.path());
+         }) == "imported 2 connections as 'twice'\n");
+  EXPECT(capture([&] { seq->list_profiles(store.path()); }) ==
+         "twice (2 connections)\n");
+
+  auto live = small_world();
+  EXPECT(capture([&] {
+           open_seq(*live)->save_profile(store.path(), "live");
+         }) == "saved 3 connections as 'live'\n");
+}
+
+/*
+ * a store with a profile saved from small_world, as it is on disk
+ */
+std::string saved_store() {
+  auto world = small_world();
+  TempFile store;
+  unlink(store.path());
+  capture([&] { open_seq(*world)->save_profile(store.path(), "live"); });
+  return store.read();
+}
+
+/*
+ * a store cut short anywhere is refused when a profile is exported or
+ * loaded, and loading it changes nothing
+ */
+void test_profile_store_truncated() {
+  auto content = saved_store();
+  EXPECT(content.size() > 0);
+  auto world = small_world();
+  auto before = serialize(*world);
+  TempFile store;
+  for (size_t size = 0; size < content.size(); size++) {
+    store.write(content.substr(0, size));
+    auto seq = open_seq(*world);
+    capture(
+        [&] {
+          EXPECT(seq->export_profile(store.path(), "live") != 0);
+          EXPECT(seq->load_profile(store.path(), "live") != 0);
+        },
+        STDERR_FILENO);
+  }
+  EXPECT(serialize(*world) == before);
+}
+
+/*
+ * a store with any one byte changed is read without going outside of it.
+ * a bad magic number or a connection naming a string past the end is
+ * refused outright
+ */
+void test_profile_store_corrupted() {
+  auto content = saved_store();
+  TempFile store;
+  for (size_t i = 0; i < content.size(); i++) {
+    auto damaged = content;
+    damaged[i] ^= 0xff;
+    store.write(damaged);
+    auto world = small_world();
+    auto seq = open_seq(*world);
+    capture(
+        [&] {
+          capture([&] {
+            seq->list_profiles(store.path());
+            seq->export_profile(store.path(), "live");
+            seq->load_profile(store.path(), "live", false, 0);
+          });
+        },
+        STDERR_FILENO);
+  }
+
+  auto seq = open_seq(*small_world());
+  auto damaged = content;
+  damaged[0] ^= 0xff;
+  store.write(damaged);
+  capture([&] { EXPECT(seq->list_profiles(store.path()) != 0); },
+          STDERR_FILENO);
+
+  // the last connection is at the end of the file, its sender first
+  damaged = content;
+  memset(&damaged[damaged.size() - sizeof(ProfileStore::Edge)], 0xff, 4);
+  store.write(damaged);
+  capture([&] { EXPECT(seq->export_profile(store.path(), "live") != 0); },
+          STDERR_FILENO);
+}
+
+// the lines of text, sorted
+std::vector<std::string> sorted_lines(const std::string &text) {
+  std::vector<std::string> lines;
+  std::istringstream in(text);
+  for (std::string line; std::getline(in, line);) {
+    lines.push_back(line);
+  }
+  std::sort(lines.begin(), lines.end());
+  return lines;
+}
+
+/*
+ * --complete offers the addresses starting with the prefix in any case,
+ * and only if there are none those containing its letters in order. a
+ * :port address is only offered for a port whose name is unique, and
+ * ':' and '.' in names come out escaped
+ */
+void test_complete() {
+  MemoryBackend world(3, 2, 0);
+  auto strip = world.open_another();
+  strip->set_client_name("Ch. Strip");
+  strip->create_port("In:A", SND_SEQ_PORT_CAP_WRITE, -1);
+  auto first = world.open_another(), second = world.open_another();
+  first->create_port("Out", SND_SEQ_PORT_CAP_READ, -1);
+  second->create_port("Out", SND_SEQ_PORT_CAP_READ, -1);
+
+  auto complete = [&](std::string_view prefix) {
+    return sorted_lines(capture([&] { open_seq(world)->complete(prefix); }));
+  };
+  using lines = std::vector<std::string>;
+  EXPECT(complete("synth 1:") ==
+         (lines{"Synth 1:Synth 1 Port 0", "Synth 1:Synth 1 Port 1"}));
+  EXPECT(complete(":SYNTH 2 port 1") == lines{":Synth 2 Port 1"});
+  EXPECT(complete(":s2p1") ==
+         (lines{":Synth 2 Port 1", "Synth 2:Synth 2 Port 1"}));
+  EXPECT(complete("ch") == lines{"Ch\\. Strip:In\\:A"});
+  EXPECT(complete(":in") == lines{":In\\:A"});
+  // two ports are called Out, so only their full addresses are offered, as
+  // containing ":Out"
+  EXPECT(complete(":Out") ==
+         (lines{fmt::format("Client-{}:Out", first->client_id()),
+                fmt::format("Client-{}:Out", second->client_id())}));
+  EXPECT(complete("Client-").size() == 2);
+  EXPECT(complete("zzz").empty());
+}
+
+/*
+ * in a --glob bracket expression, a ']' right after the '[' or the '[!' is
+ * part of the set, as in fnmatch
+ */
+void test_glob_brackets() {
+  MemoryBackend world(1, 1, 0);
+  auto glob = world.open_another();
+  glob->set_client_name("Glob");
+  for (auto name : {"]", "x", "a"}) {
+    glob->create_port(name, SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                      -1);
+  }
+  auto senders = [&](const char *pattern) {
+    auto text = capture([&] {
+      open_seq(world)->fan_out(pattern, "Synth 0:Synth 0 Port 0", false, false,
+                               Seq::PAIR_ALL, true, false);
+    });
+    std::vector<std::string> names;
+    // "+ Glob:NAME -> ..." for every connection that would be made
+    for (auto &line : sorted_lines(text)) {
+      if (line.compare(0, 7, "+ Glob:") == 0) {
+        names.push_back(line.substr(7, line.find(" -> ") - 7));
+      }
+    }
+    return names;
+  };
+  using names = std::vector<std::string>;
+  EXPECT(senders("Glob:[]]") == names{"]"});
+  EXPECT(senders("Glob:[]a]") == (names{"]", "a"}));
+  EXPECT(senders("Glob:[!]x]") == names{"a"});
+  EXPECT(senders("Glob:[^]]") == (names{"a", "x"}));
+  EXPECT(senders("Glob:[a-x]") == (names{"a", "x"}));
+}
+
+/*
+ * a loaded topology learns about clients and ports from announcements,
+ * and those the filter leaves out are dropped there as they are in a scan
+ */
+void test_filter_hotplug() {
+  for (int type : {SND_SEQ_USER_CLIENT, SND_SEQ_KERNEL_CLIENT}) {
+    MemoryBackend world(2, 2, 0);
+    auto handle = world.open_another();
+    Backend *announcements = handle.get();
+    announcements->open_announce_port();
+    Seq seq(std::move(handle));
+    PortFilter filter;
+    filter.input = true;
+    filter.client_type = type;
+    seq.set_filter(filter);
+    for (auto client : *seq.get_clients()) {
+      client->get_ports();
+    }
+
+    auto device = world.open_another();
+    device->create_port(
+        "Out", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ, -1);
+    device->create_port(
+        "In", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, -1);
+    snd_seq_event_t *ev;
+    while (announcements->event_input(&ev) >= 0) {
+      seq.update_topology(ev);
+    }
+
+    Client *added = nullptr;
+    for (auto client : *seq.get_clients()) {
+      if (client->get_index() == device->client_id()) {
+        added = client;
+      }
+    }
+    if (type == SND_SEQ_USER_CLIENT) {
+      EXPECT(added != nullptr && added->get_num_ports() == 1 &&
+             added->get_ports()->front()->get_name() == "Out");
+    } else {
+      // the only kernel client is System
+      EXPECT(added == nullptr);
+      EXPECT(seq.get_clients()->size() == 1);
+    }
+  }
+}
+
+/*
+ * routes racing for an exclusive destination on --threads workers end the
+ * same way as applied one at a time: the first one listed wins, every time
+ */
+void test_threads_exclusive_race() {
+  // Synth 0 to 3 all go to Synth 4 Port 0, taken exclusively by Synth 1,
+  // and to Synth 5 Port 0, taken exclusively by Synth 0 first
+  TempFile profile("[\"Synth 0\"]\n"
+                   "\"Synth 0 Port 0\" = [ \"Synth 4:Synth 4 Port 0\" ]\n"
+                   "\"Synth 0 Port 1\" = [ { dest = \"Synth 5:Synth 5 Port 0\","
+                   " exclusive = true } ]\n"
+                   "[\"Synth 1\"]\n"
+                   "\"Synth 1 Port 0\" = [ { dest = \"Synth 4:Synth 4 Port 0\","
+                   " exclusive = true } ]\n"
+                   "\"Synth 1 Port 1\" = [ \"Synth 5:Synth 5 Port 0\" ]\n"
+                   "[\"Synth 2\"]\n"
+                   "\"Synth 2 Port 0\" = [ \"Synth 4:Synth 4 Port 0\" ]\n"
+                   "\"Synth 2 Port 1\" = [ \"Synth 3:Synth 3 Port 1\" ]\n"
+                   "[\"Synth 3\"]\n"
+                   "\"Synth 3 Port 0\" = [ \"Synth 4:Synth 4 Port 0\" ]\n"
+                   "\"Synth 3 Port 1\" = [ \"Synth 5:Synth 5 Port 1\" ]\n");
+  auto restore = [&](int threads, std::string &connections) {
+    MemoryBackend world(6, 2, 0);
+    // long enough for the workers to overlap on every call
+    world.set_latency(std::chrono::microseconds(200));
+    auto seq = open_seq(world);
+    seq->set_threads(threads);
+    int result;
+    capture([&] {
+      capture([&] { result = seq->deserialize_connections(profile.path()); },
+              STDERR_FILENO);
+    });
+    connections = serialize(world);
+    return result;
+  };
+
+  std::string serial;
+  int serial_result = restore(1, serial);
+  EXPECT(serial_result != 0);
+  EXPECT(serial.find("\"Synth 0 Port 0\" = [ \"Synth 4:Synth 4 Port 0\" ]") !=
+         std::string::npos);
+  EXPECT(serial.find("\"Synth 1 Port 0\"") == std::string::npos);
+  EXPECT(serial.find("\"Synth 0 Port 1\" = [ { dest = \"Synth 5:Synth 5 "
+                     "Port 0\", exclusive = true } ]") != std::string::npos);
+  EXPECT(serial.find("\"Synth 1 Port 1\"") == std::string::npos);
+  EXPECT(serial.find("\"Synth 2 Port 1\"") != std::string::npos);
+
+  for (int run = 0; run < 10; run++) {
+    std::string parallel;
+    EXPECT(restore(4, parallel) == serial_result);
+    EXPECT(parallel == serial);
+  }
+}
+
+/*
+ * more probes than their two bytes can number are refused before anything
+ * is connected
+ */
+void test_probe_iterations() {
+  MemoryBackend world(2, 2, 0);
+  Trace trace;
+  auto seq = open_seq(world, &trace);
+  int result;
+  capture([&] { result = seq->probe(nullptr, nullptr, 16385, 10, nullptr); },
+          STDERR_FILENO);
+  EXPECT(result != 0);
+  EXPECT(trace.calls(Trace::SUBSCRIBE_PORT) == 0);
+}
+
+/*
+ * --analyze exits with 1 when the live connections or a profile loop, and
+ * with 0 when they don't, whatever the format
+ */
+void test_analyze_exit() {
+  auto world = small_world();
+  auto seq = open_seq(*world);
+  int result = -1, dot = -1;
+  capture([&] {
+    result = seq->analyze(nullptr);
+    dot = seq->analyze(nullptr, Seq::FORMAT_DOT);
+  });
+  EXPECT(result == 0);
+  EXPECT(dot == 0);
+
+  auto looping = small_world();
+  EXPECT(open_seq(*looping)->subscribe("19:1", "17:1") == 0);
+  TempFile profile(serialize(*looping));
+  capture([&] {
+    result = open_seq(*looping)->analyze(nullptr);
+    dot = open_seq(*looping)->analyze(nullptr, Seq::FORMAT_DOT);
+  });
+  EXPECT(result == 1);
+  EXPECT(dot == 1);
+
+  // the profile is checked, not the live connections it would replace
+  capture([&] { result = open_seq(*world)->analyze(profile.path()); });
+  EXPECT(result == 1);
+}
+
+/*
+ * with --refuse-cycles, a connection that closes a loop is not made, and a
+ * profile that would loop with what it leaves in place restores nothing.
+ * without it both go ahead
+ */
+void test_refuse_cycles() {
+  auto world = small_world();
+  auto before = serialize(*world);
+  Trace trace;
+  auto seq = open_seq(*world, &trace);
+  seq->set_refuse_cycles(true);
+  capture([&] { EXPECT(seq->subscribe("19:1", "17:1") != 0); },
+          STDERR_FILENO);
+  EXPECT(trace.calls(Trace::SUBSCRIBE_PORT) == 0);
+  EXPECT(seq->subscribe("19:1", "16:0") == 0);
+  EXPECT(open_seq(*world)->unsubscribe((char *)"19:1", (char *)"16:0") == 0);
+  EXPECT(serialize(*world) == before);
+  {
+    auto allowing = open_seq(*world);
+    EXPECT(allowing->subscribe("19:1", "17:1") == 0);
+    EXPECT(allowing->unsubscribe((char *)"19:1", (char *)"17:1") == 0);
+  }
+
+  // 17:1 -> 19:1 is live, the profile only goes back the other way
+  TempFile profile("[\"Synth 3\"]\n"
+                   "\"Synth 3 Port 1\" = [ \"Synth 1:Synth 1 Port 1\" ]\n");
+  auto restore = [&](bool refuse, bool reconcile, bool remove_prev) {
+    Trace restore_trace;
+    auto restoring = open_seq(*world, &restore_trace);
+    restoring->set_refuse_cycles(refuse);
+    int result;
+    capture([&] {
+      capture(
+          [&] {
+            result = reconcile ? restoring->reconcile_connections(
+                                     profile.path())
+                               : restoring->deserialize_connections(
+                                     profile.path(), remove_prev);
+          },
+          STDERR_FILENO);
+    });
+    return std::make_tuple(result,
+                           restore_trace.calls(Trace::SUBSCRIBE_PORT) +
+                               restore_trace.calls(Trace::UNSUBSCRIBE_PORT));
+  };
+
+  EXPECT(restore(true, false, false) == std::make_tuple(1, 0L));
+  EXPECT(serialize(*world) == before);
+
+  // replacing everything leaves 17:1 -> 19:1 out, so there is no loop
+  auto [result, calls] = restore(true, false, true);
+  EXPECT(result == 0);
+  EXPECT(calls > 0);
+  auto replaced = serialize(*world);
+  EXPECT(replaced.find("\"Synth 3 Port 1\"") != std::string::npos);
+  EXPECT(replaced.find("\"Synth 1 Port 1\"") == std::string::npos);
+
+  // the other way round the loop, with everything else as it was
+  profile.write(before +
+                "\n[\"Synth 3\"]\n"
+                "\"Synth 3 Port 1\" = [ \"Synth 1:Synth 1 Port 1\" ]\n");
+  EXPECT(restore(true, true, true) == std::make_tuple(1, 0L));
+  EXPECT(serialize(*world) == replaced);
+  EXPECT(restore(true, false, true) == std::make_tuple(1, 0L));
+  EXPECT(serialize(*world) == replaced);
+  EXPECT(std::get<0>(restore(false, false, true)) == 0);
+  EXPECT(serialize(*world) != replaced);
+}
+
+struct Case {
+  const char *name;
+  void (*run)();
+};
+
+const Case cases[] = {
+    {"reconcile_unchanged", test_reconcile_unchanged},
+    {"reconcile_difference", test_reconcile_difference},
+    {"exclusive_subscribe", test_exclusive_subscribe},
+    {"batch_atomic_rollback", test_batch_atomic_rollback},
+    {"batch_atomic_unresolved", test_batch_atomic_unresolved},
+    {"serialize_sorted", test_serialize_sorted},
+    {"profile_counts", test_profile_counts},
+    {"profile_store_truncated", test_profile_store_truncated},
+    {"profile_store_corrupted", test_profile_store_corrupted},
+    {"complete", test_complete},
+    {"glob_brackets", test_glob_brackets},
+    {"filter_hotplug", test_filter_hotplug},
+    {"threads_exclusive_race", test_threads_exclusive_race},
+    {"probe_iterations", test_probe_iterations},
+    {"analyze_exit", test_analyze_exit},
+    {"refuse_cycles", test_refuse_cycles},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--list") == 0) {
+    for (auto &c : cases) {
+      fmt::print("{}\n", c.name);
+    }
+    return 0;
+  }
+  for (int i = 1; i < argc; i++) {
+    auto named = [&](const Case &c) {
+      return strcmp(c.name, argv[i]) == 0;
+    };
+    if (std::none_of(std::begin(cases), std::end(cases), named)) {
+      fmt::print(stderr, "unknown case '{}'\n", argv[i]);
+      return 1;
+    }
+  }
+  for (auto &c : cases) {
+    if (argc == 1 || std::any_of(argv + 1, argv + argc, [&](const char *arg) {
+          return strcmp(c.name, arg) == 0;
+        })) {
+      int before = failures;
+      c.run();
+      fmt::print(stderr, "{} {}\n", failures == before ? "ok  " : "FAIL",
+                 c.name);
+    }
+  }
+  return failures != 0;
+}